@@ -13,6 +13,79 @@
     {
         return ( access( name.c_str(), F_OK ) != -1 );
     }
+
+    /*
+        All flushes and fences go through these wrappers, which count them per thread.
+        Counters of exited threads are kept so totals cover the whole run.
+    */
+    struct PersistCounter
+    {
+        std::atomic<uint64_t> flushes{0};
+        std::atomic<uint64_t> fences{0};
+    } __attribute__((aligned(64)));
+
+    static std::mutex persist_counters_lock;
+    static std::vector<PersistCounter*> persist_counters;
+
+    static PersistCounter* registerPersistCounter()
+    {
+        PersistCounter* counter = new PersistCounter();
+        std::lock_guard<std::mutex> guard(persist_counters_lock);
+        persist_counters.push_back(counter);
+        return counter;
+    }
+    static thread_local PersistCounter* persist_counter = registerPersistCounter();
+
+    static inline void pmemFlush(const void* addr, size_t len)
+    {
+        uintptr_t first = reinterpret_cast<uintptr_t> (addr) >> 6;
+        uintptr_t last = (reinterpret_cast<uintptr_t> (addr) + len - 1) >> 6;
+        persist_counter->flushes.fetch_add(last - first + 1, std::memory_order_relaxed);
+        pmemobj_flush(pop, addr, len);
+    }
+
+    static inline void pmemFence()
+    {
+        persist_counter->fences.fetch_add(1, std::memory_order_relaxed);
+        pmemobj_drain(pop);
+    }
+
+    static inline void pmemPersist(const void* addr, size_t len)
+    {
+        pmemFlush(addr, len);
+        pmemFence();
+    }
+
+    // write with non-temporal stores, durable after the next pmemFence; lines written count as flushes
+    static inline void pmemCopyNT(void* dst, const void* src, size_t len)
+    {
+        uintptr_t first = reinterpret_cast<uintptr_t> (dst) >> 6;
+        uintptr_t last = (reinterpret_cast<uintptr_t> (dst) + len - 1) >> 6;
+        persist_counter->flushes.fetch_add(last - first + 1, std::memory_order_relaxed);
+        pmemobj_memcpy(pop, dst, src, len, PMEMOBJ_F_MEM_NONTEMPORAL | PMEMOBJ_F_MEM_NODRAIN);
+    }
+
+    PersistStats FPtree::persistStats()
+    {
+        PersistStats stats = {0, 0};
+        std::lock_guard<std::mutex> guard(persist_counters_lock);
+        for (PersistCounter* counter : persist_counters)
+        {
+            stats.flushes += counter->flushes.load(std::memory_order_relaxed);
+            stats.fences += counter->fences.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
+    void FPtree::resetPersistStats()
+    {
+        std::lock_guard<std::mutex> guard(persist_counters_lock);
+        for (PersistCounter* counter : persist_counters)
+        {
+            counter->flushes.store(0, std::memory_order_relaxed);
+            counter->fences.store(0, std::memory_order_relaxed);
+        }
+    }
 #endif
 
 BaseNode::BaseNode() 
@@ -24,6 +97,9 @@ InnerNode::InnerNode()
 {
     this->isInnerNode = true;
     this->nKey = 0;
+    #ifdef OLC
+        this->version.store(0, std::memory_order_relaxed);
+    #endif
 }
 
 InnerNode::InnerNode(uint64_t key, BaseNode* left, BaseNode* right)
@@ -33,6 +109,9 @@ InnerNode::InnerNode(uint64_t key, BaseNode* left, BaseNode* right)
     this->p_children[0] = left;
     this->p_children[1] = right;
     this->nKey = 1;
+    #ifdef OLC
+        this->version.store(0, std::memory_order_relaxed);
+    #endif
 }
 
 void InnerNode::init(uint64_t key, BaseNode* left, BaseNode* right)
@@ -51,7 +130,15 @@ InnerNode::InnerNode(const InnerNode& inner)
 
 InnerNode::~InnerNode()
 {
-    for (size_t i = 0; i < this->nKey; i++) { delete this->p_children[i]; }
+    for (size_t i = 0; i < this->nKey; i++)
+    {
+        if (this->p_children[i]->isInnerNode)
+            delete reinterpret_cast<InnerNode*> (this->p_children[i]);
+        #ifndef PMEM
+            else
+                delete reinterpret_cast<LeafNode*> (this->p_children[i]);
+        #endif
+    }
 }
 
 #ifndef PMEM
@@ -75,6 +162,98 @@ InnerNode::~InnerNode()
     }
 #endif
 
+std::atomic<uint64_t> Epoch::global_epoch{1};
+std::atomic<Epoch::Record*> Epoch::records{nullptr};
+thread_local Epoch::Handle Epoch::handle;
+
+Epoch::Handle::~Handle()
+{
+    if (record)     // pending nodes stay with the record for the next thread that takes it
+        record->in_use.store(false, std::memory_order_release);
+}
+
+Epoch::Record* Epoch::self()
+{
+    if (handle.record)
+        return handle.record;
+    for (Record* r = records.load(std::memory_order_acquire); r; r = r->next)
+    {
+        bool free = false;
+        if (!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(free, true))
+            return handle.record = r;
+    }
+    Record* r = new Record();
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r));
+    return handle.record = r;
+}
+
+void Epoch::enter()
+{
+    Record* r = self();
+    if (r->depth++ == 0)
+    {
+        r->epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+void Epoch::exit()
+{
+    Record* r = handle.record;
+    if (--r->depth != 0)
+        return;
+    r->epoch.store(0, std::memory_order_release);
+    if (r->retired_since_reclaim >= RECLAIM_BATCH)
+    {
+        r->retired_since_reclaim = 0;
+        tryAdvance();
+        reclaim(r, false);
+    }
+}
+
+void Epoch::retire(void* node, Deleter deleter)
+{
+    Record* r = self();
+    tbb::spin_mutex::scoped_lock guard(r->limbo_lock);
+    r->limbo.push_back(Retired{node, deleter, global_epoch.load(std::memory_order_acquire)});
+    r->retired_since_reclaim++;
+}
+
+void Epoch::tryAdvance()
+{
+    uint64_t e = global_epoch.load(std::memory_order_seq_cst);
+    for (Record* r = records.load(std::memory_order_acquire); r; r = r->next)
+    {
+        uint64_t local = r->epoch.load(std::memory_order_seq_cst);
+        if (local && local != e)
+            return;
+    }
+    global_epoch.compare_exchange_strong(e, e + 1);
+}
+
+void Epoch::reclaim(Record* record, bool all)
+{
+    std::vector<Retired> expired;
+    {
+        uint64_t e = global_epoch.load(std::memory_order_seq_cst);
+        tbb::spin_mutex::scoped_lock guard(record->limbo_lock);
+        auto end = record->limbo.begin();
+        while (end != record->limbo.end() && (all || end->epoch + 2 <= e))
+            ++end;
+        expired.assign(record->limbo.begin(), end);
+        record->limbo.erase(record->limbo.begin(), end);
+    }
+    for (Retired& r : expired)
+        r.deleter(r.node);
+}
+
+void Epoch::drain()
+{
+    for (Record* r = records.load(std::memory_order_acquire); r; r = r->next)
+        reclaim(r, true);
+}
+
 void InnerNode::removeKey(uint64_t index, bool remove_right_child = true)
 {
     assert(this->nKey > index && "Remove key index out of range!");
@@ -97,14 +276,96 @@ void InnerNode::addKey(uint64_t index, uint64_t key, BaseNode* child, bool add_c
     this->nKey++;
 }
 
+void InnerNode::addKeys(uint64_t index, const uint64_t* keys, BaseNode* const* children, uint64_t n)
+{
+    assert(this->nKey >= index && this->nKey + n <= MAX_INNER_SIZE && "Insert keys out of range!");
+    std::memmove(this->keys+index+n, this->keys+index, (this->nKey-index)*sizeof(uint64_t));
+    std::memcpy(this->keys+index, keys, n*sizeof(uint64_t));
+    std::memmove(this->p_children+index+n+1, this->p_children+index+1, (this->nKey-index)*sizeof(BaseNode*));
+    std::memcpy(this->p_children+index+1, children, n*sizeof(BaseNode*));
+    this->nKey += n;
+}
+
+void InnerNode::removeChildren(uint64_t first, uint64_t last)
+{
+    assert(first <= last && last - first < this->nKey && "Remove children out of range!");
+    uint64_t n = last - first + 1, key = first ? first - 1 : 0;
+    std::memmove(this->keys + key, this->keys + key + n, (this->nKey - key - n)*sizeof(uint64_t));
+    std::memmove(this->p_children + first, this->p_children + last + 1, (this->nKey - last)*sizeof(BaseNode*));
+    this->nKey -= n;
+}
+
+#ifdef SIMD_INNER_SEARCH
+/*
+    Inner node key counters: return the number of keys[0..nKey) that are <= key.
+    Keys are sorted, so the matching lanes of a chunk always form a prefix and the
+    scan stops at the first chunk that is not entirely <= key.
+*/
+__attribute__((target("avx512f")))
+static uint64_t countKeysLessEqualAVX512(const uint64_t* keys, uint64_t nKey, uint64_t key)
+{
+    __m512i target = _mm512_set1_epi64(key);
+    for (uint64_t i = 0; i < nKey; i += 8)
+    {
+        __mmask8 valid = nKey - i >= 8 ? 0xff : (1 << (nKey - i)) - 1;
+        __m512i chunk = _mm512_maskz_loadu_epi64(valid, keys + i);
+        __mmask8 le = _mm512_mask_cmple_epu64_mask(valid, chunk, target);
+        if (le != 0xff)
+            return i + __builtin_popcount(le);
+    }
+    return nKey;
+}
+
+__attribute__((target("avx2")))
+static uint64_t countKeysLessEqualAVX2(const uint64_t* keys, uint64_t nKey, uint64_t key)
+{
+    // AVX2 only compares signed 64-bit lanes, flip the sign bit to get an unsigned order
+    const __m256i sign = _mm256_set1_epi64x(1ULL << 63);
+    __m256i target = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+    uint64_t i = 0;
+    for (; i + 4 <= nKey; i += 4)
+    {
+        __m256i chunk = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), sign);
+        int gt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(chunk, target)));
+        if (gt)
+            return i + __builtin_ctz(gt);
+    }
+    for (; i < nKey && keys[i] <= key; i++);
+    return i;
+}
+
+static uint64_t countKeysLessEqualScalar(const uint64_t* keys, uint64_t nKey, uint64_t key)
+{
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < nKey; i++)
+        count += keys[i] <= key;
+    return count;
+}
+
+typedef uint64_t (*InnerKeyCounter)(const uint64_t* keys, uint64_t nKey, uint64_t key);
+
+static InnerKeyCounter resolveInnerKeyCounter()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return countKeysLessEqualAVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return countKeysLessEqualAVX2;
+    return countKeysLessEqualScalar;
+}
+
+static const InnerKeyCounter innerKeyCounter = resolveInnerKeyCounter();
+
+inline uint64_t InnerNode::findChildIndex(uint64_t key)
+{
+    return innerKeyCounter(this->keys, this->nKey, key);
+}
+#else
 inline uint64_t InnerNode::findChildIndex(uint64_t key)
 {
-    auto lower = std::lower_bound(this->keys, this->keys + this->nKey, key);
-    uint64_t idx = lower - this->keys;
-    if (idx < this->nKey && *lower == key)
-        idx++;
-    return idx;
+    return std::upper_bound(this->keys, this->keys + this->nKey, key) - this->keys;
 }
+#endif
 
 inline void LeafNode::addKV(struct KV kv)
 {
@@ -112,20 +373,82 @@ inline void LeafNode::addKV(struct KV kv)
     assert(idx < MAX_LEAF_SIZE && "Insert kv out of bound!");
     this->fingerprints[idx] = getOneByteHash(kv.key);
     this->kv_pairs[idx] = kv;
+    this->addSortedSlot(idx);
     this->bitmap.set(idx);
 }
 
+/*
+    Fingerprint probes: compare all fingerprints of a leaf against one hash at once.
+    Bit i of the returned mask is set if fingerprints[i] == hash. Every probe reads the
+    64 bytes starting at fingerprints, which stay inside the leaf header (bits beyond
+    MAX_LEAF_SIZE are garbage and must be masked with the bitmap). Loads are unaligned:
+    leaves in a pool are only as aligned as the allocator makes them, and an unaligned
+    load of an aligned line costs the same.
+*/
+__attribute__((target("avx512bw")))
+static uint64_t fingerprintMaskAVX512(const uint8_t* fingerprints, uint8_t hash)
+{
+    __m512i line = _mm512_loadu_si512(reinterpret_cast<const void*>(fingerprints));
+    return _mm512_cmpeq_epi8_mask(line, _mm512_set1_epi8(hash));
+}
+
+__attribute__((target("avx2")))
+static uint64_t fingerprintMaskAVX2(const uint8_t* fingerprints, uint8_t hash)
+{
+    __m256i target = _mm256_set1_epi8(hash);
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fingerprints));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fingerprints + 32));
+    uint64_t mask_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, target));
+    uint64_t mask_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, target));
+    return mask_lo | (mask_hi << 32);
+}
+
+// SSE2 is part of the x86-64 baseline, so this is the fallback for every other host
+static uint64_t fingerprintMaskSSE(const uint8_t* fingerprints, uint8_t hash)
+{
+    __m128i target = _mm_set1_epi8(hash);
+    uint64_t mask = 0;
+    for (size_t i = 0; i < 4; i++)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fingerprints + i * 16));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, target)) << (i * 16);
+    }
+    return mask;
+}
+
+typedef uint64_t (*FingerprintProbe)(const uint8_t* fingerprints, uint8_t hash);
+
+static FingerprintProbe resolveFingerprintProbe()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return fingerprintMaskAVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return fingerprintMaskAVX2;
+    return fingerprintMaskSSE;
+}
+
+// picked once at load time so one binary runs on hosts with or without AVX-512
+static const FingerprintProbe fingerprintProbe = resolveFingerprintProbe();
+
+inline uint64_t LeafNode::matchFingerprints(uint64_t key)
+{
+    return fingerprintProbe(this->fingerprints, getOneByteHash(key)) & this->bitmap.bits;
+}
+
 inline uint64_t LeafNode::findKVIndex(uint64_t key)
 {
-    size_t key_hash = getOneByteHash(key);
-    for (uint64_t i = 0; i < MAX_LEAF_SIZE; i++) 
+    return this->findKVIndex(key, this->matchFingerprints(key));
+}
+
+inline uint64_t LeafNode::findKVIndex(uint64_t key, uint64_t candidates)
+{
+    while (candidates)
     {
-        if (this->bitmap.test(i) == 1 &&
-            this->fingerprints[i] == key_hash &&
-            this->kv_pairs[i].key == key)
-        {
+        uint64_t i = __builtin_ctzll(candidates);
+        if (this->kv_pairs[i].key == key)
             return i;
-        }
+        candidates &= candidates - 1;
     }
     return MAX_LEAF_SIZE;
 }
@@ -142,6 +465,72 @@ uint64_t LeafNode::minKey()
     return min_key;
 }
 
+void LeafNode::sortSlots()
+{
+    uint8_t* slots = this->sortedSlots();
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < MAX_LEAF_SIZE; i++)
+        if (this->bitmap.test(i))
+            slots[n++] = i;
+    std::sort(slots, slots + n, [this] (uint8_t a, uint8_t b) {
+        return this->kv_pairs[a].key < this->kv_pairs[b].key;
+    });
+}
+
+void LeafNode::rebuildFingerprints()
+{
+    for (uint64_t bits = this->bitmap.bits; bits; bits &= bits - 1)
+    {
+        uint64_t i = __builtin_ctzll(bits);
+        this->fingerprints[i] = getOneByteHash(this->kv_pairs[i].key);
+    }
+}
+
+void LeafNode::addSortedSlot(uint64_t slot)
+{
+    uint8_t* slots = this->sortedSlots();
+    uint64_t n = this->bitmap.count();
+    uint64_t pos = this->findSortedPos(this->kv_pairs[slot].key);
+    std::memmove(slots + pos + 1, slots + pos, n - pos);
+    slots[pos] = slot;
+}
+
+void LeafNode::removeSortedSlot(uint64_t slot)
+{
+    uint8_t* slots = this->sortedSlots();
+    uint64_t n = this->bitmap.count();
+    uint64_t pos = std::find(slots, slots + n, slot) - slots;
+    assert(pos < n && "Slot not found in sorted slots!");
+    std::memmove(slots + pos, slots + pos + 1, n - pos - 1);
+}
+
+void LeafNode::removeSortedSlots(uint64_t mask)
+{
+    uint8_t* slots = this->sortedSlots();
+    uint64_t n = this->bitmap.count(), j = 0;
+    for (uint64_t i = 0; i < n; i++)
+        if (!(mask & ((uint64_t)1 << slots[i])))
+            slots[j++] = slots[i];
+}
+
+void LeafNode::replaceSortedSlot(uint64_t old_slot, uint64_t new_slot)
+{
+    uint8_t* slots = this->sortedSlots();
+    uint64_t n = this->bitmap.count();
+    uint8_t* pos = std::find(slots, slots + n, old_slot);
+    assert(pos != slots + n && "Slot not found in sorted slots!");
+    *pos = new_slot;
+}
+
+uint64_t LeafNode::findSortedPos(uint64_t key)
+{
+    const uint8_t* slots = this->sortedSlots();
+    uint64_t n = this->bitmap.count(), pos = 0;
+    while (pos < n && this->kv_pairs[slots[pos]].key < key)
+        pos++;
+    return pos;
+}
+
 void LeafNode::getStat(uint64_t key, LeafNodeStat& lstat)
 {
     lstat.count = 0;
@@ -172,140 +561,513 @@ inline LeafNode* FPtree::maxLeaf(BaseNode* node)
     return reinterpret_cast<LeafNode*> (node);
 }
 
+// split [0, n) into num_threads contiguous ranges and run body on each, one range on the calling thread
+static void parallelFor(size_t n, unsigned num_threads, const std::function<void(size_t, size_t)>& body)
+{
+    num_threads = std::max<size_t>(1, std::min<size_t>(num_threads, n / 1024));
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < num_threads; t++)
+        workers.emplace_back(body, n * t / num_threads, n * (t + 1) / num_threads);
+    body(0, n / num_threads);
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
 #ifdef PMEM
-    static TOID(struct Log) allocLogArray()
+    /*
+        Leaf allocator: free leaves sit in a per-thread cache in front of a shared pool, both in
+        DRAM. Groups of LEAF_GROUP_SIZE leaves are allocated when the pool runs dry.
+    */
+    static const size_t LEAF_CACHE_BATCH = 16;
+    static std::mutex leaf_pool_lock;
+    static std::vector<LeafNode*> leaf_pool;
+
+    struct LeafCache
+    {
+        std::vector<LeafNode*> leaves;
+
+        ~LeafCache()
+        {
+            std::lock_guard<std::mutex> guard(leaf_pool_lock);
+            leaf_pool.insert(leaf_pool.end(), leaves.begin(), leaves.end());
+        }
+    };
+    static thread_local LeafCache leaf_cache;
+
+    /*
+        LeafNode is aligned(64), so the leaves of a group sit on cache-line boundaries only if the
+        group itself does. The default classes of libpmemobj align to 16 bytes, groups therefore
+        come from their own class, registered again on every pmemInit since classes are not stored
+        in the pool.
+    */
+    static unsigned leaf_group_class;
+
+    static bool registerLeafGroupClass()
     {
-        TOID(struct Log) array = POBJ_ROOT(pop, struct Log);
+        struct pobj_alloc_class_desc desc;
+        desc.unit_size = sizeof(struct LeafGroup);
+        desc.alignment = 64;
+        desc.units_per_block = 16;
+        desc.header_type = POBJ_HEADER_COMPACT;
+        if (pmemobj_ctl_set(pop, "heap.alloc_class.new.desc", &desc))
+        {
+            perror("failed to register leaf group class\n");
+            return false;
+        }
+        leaf_group_class = desc.class_id;
+        return true;
+    }
 
-        POBJ_ALLOC(pop, &array, struct Log, sizeof(struct Log) * sizeLogArray,
-                    NULL, NULL);
+    static int constructLeafGroup(PMEMobjpool *pop, void *ptr, void *arg)
+    {
+        struct LeafGroup *group = (struct LeafGroup *)ptr;
+        group->next = *(TOID(struct LeafGroup) *)arg;
+        group->id = TOID_IS_NULL(group->next) ? 0 : D_RO(group->next)->id + 1;
+        pmemPersist(group, sizeof(group->next) + sizeof(group->id));
+        memset(group->leaves, 0, sizeof(group->leaves));
+        for (size_t i = 0; i < LEAF_GROUP_SIZE; i++)
+            group->leaves[i].lock_id = group->id * LEAF_GROUP_SIZE + i;
+        pmemPersist(group->leaves, sizeof(group->leaves));
+        return 0;
+    }
 
-        if (TOID_IS_NULL(array)) { fprintf(stderr, "POBJ_ALLOC\n"); return OID_NULL; }
+    // lock chunk of a leaf group, its block of the lock table is allocated on first use.
+    // Called under leaf_pool_lock or during recovery
+    static LeafLock*& leafLockChunk(uint64_t group_id)
+    {
+        LeafLock**& block = leaf_locks[group_id >> LOCK_DIR_BITS];
+        if (block == nullptr)
+            block = new LeafLock*[1 << LOCK_DIR_BITS]();
+        return block[group_id & ((1 << LOCK_DIR_BITS) - 1)];
+    }
 
-        for (uint64_t i = 0; i < sizeLogArray; i++) 
+    static LeafNode* allocLeaf()
+    {
+        std::vector<LeafNode*>& cache = leaf_cache.leaves;
+        if (cache.empty())
         {
-            if (POBJ_ALLOC(pop, &D_RW(array)[i],
-                struct Log, sizeof(struct Log),
-                NULL, NULL)) 
+            std::lock_guard<std::mutex> guard(leaf_pool_lock);
+            if (leaf_pool.empty())
             {
-                fprintf(stderr, "pmemobj_alloc\n");
+                // the allocation publishes the group at the head of List::groups atomically
+                TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+                TOID(struct LeafGroup) groups = D_RO(ListHead)->groups;
+                if (!TOID_IS_NULL(groups) && D_RO(groups)->id + 1 >= MAX_LEAF_GROUPS)
+                {
+                    fprintf(stderr, "leaf lock table full\n");
+                    return nullptr;
+                }
+                if (POBJ_XALLOC(pop, &D_RW(ListHead)->groups, struct LeafGroup, sizeof(struct LeafGroup),
+                                POBJ_CLASS_ID(leaf_group_class), constructLeafGroup, &groups))
+                {
+                    fprintf(stderr, "pmemobj_xalloc\n");
+                    return nullptr;
+                }
+                struct LeafGroup* group = D_RW(D_RW(ListHead)->groups);
+                leafLockChunk(group->id) = new LeafLock[LEAF_GROUP_SIZE];
+                for (size_t i = LEAF_GROUP_SIZE; i-- > 0; )
+                    leaf_pool.push_back(&group->leaves[i]);
             }
-        }	
-        return array.oid;
+            size_t n = std::min(LEAF_CACHE_BATCH, leaf_pool.size());
+            cache.assign(leaf_pool.end() - n, leaf_pool.end());
+            leaf_pool.resize(leaf_pool.size() - n);
+        }
+        LeafNode* leaf = cache.back();
+        cache.pop_back();
+        return leaf;
     }
 
-    static TOID(struct Log) root_LogArray;
-
-    void FPtree::recover()
+    // leaf must already be unreachable from the leaf list
+    static void freeLeaf(LeafNode* leaf)
     {
-        root_LogArray = POBJ_ROOT(pop, struct Log);
-        for (uint64_t i = 1; i < sizeLogArray / 2; i++)
-        {
-            recoverSplit(&D_RW(root_LogArray)[i]);
-        }
-        for (uint64_t i = sizeLogArray / 2; i < sizeLogArray; i++)
+        std::vector<LeafNode*>& cache = leaf_cache.leaves;
+        cache.push_back(leaf);
+        if (cache.size() >= 2 * LEAF_CACHE_BATCH)
         {
-            recoverDelete(&D_RW(root_LogArray)[i]);
+            std::lock_guard<std::mutex> guard(leaf_pool_lock);
+            leaf_pool.insert(leaf_pool.end(), cache.end() - LEAF_CACHE_BATCH, cache.end());
+            cache.resize(cache.size() - LEAF_CACHE_BATCH);
         }
     }
 
-    void FPtree::pmemInit(const char* path_ptr, long long pool_size)
+    // after recovery, every leaf in a group that is not one of the listed leaves is free. A lazy rebuild
+    // only covers the groups it started with, the free leaves of later groups are in the pool already
+    static void rebuildLeafPool(const std::vector<BaseNode*>& leaves, unsigned num_threads, 
+                                uint64_t old_groups = MAX_LEAF_GROUPS)
     {
-        if (file_pool_exists(path_ptr) == 0) 
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        TOID(struct LeafGroup) groups = D_RO(ListHead)->groups;
+        uint64_t num_groups = TOID_IS_NULL(groups) ? 0 : D_RO(groups)->id + 1;
+        std::vector<uint8_t> used(num_groups * LEAF_GROUP_SIZE, 0);
+        parallelFor(leaves.size(), num_threads, [&] (size_t begin, size_t end)
         {
-            if ((pop = pmemobj_create(path_ptr, POBJ_LAYOUT_NAME(FPtree), pool_size, 0666)) == NULL) 
-                perror("failed to create pool\n");
-            root_LogArray = allocLogArray();
-        } 
-        else 
+            for (size_t i = begin; i < end; i++)
+                used[reinterpret_cast<LeafNode*> (leaves[i])->lock_id] = 1;
+        });
+
+        std::lock_guard<std::mutex> guard(leaf_pool_lock);
+        if (old_groups == MAX_LEAF_GROUPS)
         {
-            if ((pop = pmemobj_open(path_ptr, POBJ_LAYOUT_NAME(FPtree))) == NULL)
-                perror("failed to open pool\n");
-            else 
-            {
-                recover();
-                bulkLoad(1);
-            }
+            leaf_pool.clear();
+            leaf_cache.leaves.clear();
         }
-        root_LogArray = POBJ_ROOT(pop, struct Log);  // Avoid push root object to Queue, i = 1
-        for (uint64_t i = 1; i < sizeLogArray / 2; i++)   // push persistent array to splitLogQueue
-        {   
-            D_RW(root_LogArray)[i].PCurrentLeaf = OID_NULL;
-            D_RW(root_LogArray)[i].PLeaf = OID_NULL;
-            splitLogQueue.push(&D_RW(root_LogArray)[i]);
-        }
-        for (uint64_t i = sizeLogArray / 2; i < sizeLogArray; i++) // second half of array use as delete log
+        for (TOID(struct LeafGroup) group = groups; !TOID_IS_NULL(group); group = D_RO(group)->next)
         {
-            D_RW(root_LogArray)[i].PCurrentLeaf = OID_NULL;
-            D_RW(root_LogArray)[i].PLeaf = OID_NULL;
-            deleteLogQueue.push(&D_RW(root_LogArray)[i]);
+            if (D_RO(group)->id >= old_groups)
+                continue;
+            for (size_t i = LEAF_GROUP_SIZE; i-- > 0; )
+            {
+                LeafNode* leaf = &D_RW(group)->leaves[i];
+                if (!used[leaf->lock_id])
+                    leaf_pool.push_back(leaf);
+            }
         }
     }
 
-#endif
-
-FPtree::FPtree() 
-{
-    root = nullptr;
-    #ifndef PMEM
-        bitmap_idx = MAX_LEAF_SIZE;
-    #endif
-}
+    // first leaf with a key starting at cursor, lookups pass over empty leaves during a lazy rebuild.
+    // A leaf that had its low key fixed keeps its place even if it is empty now
+    static LeafNode* firstLeaf(TOID(struct LeafNode) cursor)
+    {
+        while (!TOID_IS_NULL(cursor) && D_RW(cursor)->bitmap.count() == 0 &&
+               !(D_RW(cursor)->lockEntry().lazy_state.load(std::memory_order_acquire) & LOW_KEY_SET))
+            cursor = D_RO(cursor)->p_next;
+        return TOID_IS_NULL(cursor) ? nullptr : D_RW(cursor);
+    }
 
+    // separator of a non-empty leaf in the index being rebuilt, fixed the first time it is asked for:
+    // a leaf is reached only for keys >= its low key, so it never receives a smaller key afterwards
+    static uint64_t lowKey(LeafNode* leaf)
+    {
+        LeafLock& entry = leaf->lockEntry();
+        if (entry.lazy_state.load(std::memory_order_acquire) & LOW_KEY_SET)
+            return entry.low_key.load(std::memory_order_relaxed);
+        uint64_t key = leaf->minKey();
+        entry.low_key.store(key, std::memory_order_relaxed);
+        entry.lazy_state.fetch_or(LOW_KEY_SET, std::memory_order_release);
+        return key;
+    }
 
-FPtree::~FPtree() 
-{
-    #ifdef PMEM
-        pmemobj_close(pop);
-    #else
-        if (root != nullptr)
-            delete root;
-    #endif  
-}
+    // rebuild the volatile parts of a locked leaf before its first use after the restart
+    static void prepareLeaf(LeafNode* leaf)
+    {
+        LeafLock& entry = leaf->lockEntry();
+        if (entry.lazy_state.load(std::memory_order_relaxed) & PREPARED)
+            return;
+        leaf->rebuildFingerprints();
+        leaf->sortSlots();
+        entry.lazy_state.fetch_or(PREPARED, std::memory_order_release);
+    }
 
+    // a leaf created by a split is linked prepared with its min key as low key, a lazy rebuild may be running
+    static void markLeafPrepared(LeafNode* leaf, uint64_t low_key)
+    {
+        LeafLock& entry = leaf->lockEntry();
+        entry.low_key.store(low_key, std::memory_order_relaxed);
+        entry.lazy_state.store(LOW_KEY_SET | PREPARED, std::memory_order_release);
+    }
 
-inline static uint8_t getOneByteHash(uint64_t key)
-{
-    uint8_t oneByteHashKey = std::_Hash_bytes(&key, sizeof(key), 1) & 0xff;
-    return oneByteHashKey;
-}
+    // locks are volatile, whatever was held before the restart is released. The table of a pool
+    // opened before is freed first, group ids restart in every pool. No other thread may still
+    // hold leaves of that pool, in its leaf cache or in the limbo lists of Epoch
+    static void resetLeafLocks()
+    {
+        for (LeafLock**& block : leaf_locks)
+        {
+            if (block == nullptr)
+                continue;
+            for (uint64_t i = 0; i < ((uint64_t)1 << LOCK_DIR_BITS); i++)
+                delete[] block[i];
+            delete[] block;
+            block = nullptr;
+        }
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        for (TOID(struct LeafGroup) group = D_RO(ListHead)->groups; !TOID_IS_NULL(group); group = D_RO(group)->next)
+            leafLockChunk(D_RO(group)->id) = new LeafLock[LEAF_GROUP_SIZE];
+    }
 
+    /*
+        Each thread takes a LogSlot in the persistent root the first time it needs a log and keeps
+        it until it exits, so splits and deletes never contend on a shared log queue.
+    */
+    static LogSlot* log_slots;
+    static std::atomic<bool> log_slot_used[MAX_LOG_SLOTS];
 
-#ifdef PMEM
-    static void showList()
+    struct LogSlotHandle
     {
-        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
-        TOID(struct LeafNode) leafNode = D_RO(ListHead)->head;
+        int64_t idx = -1;
 
-        while (!TOID_IS_NULL(leafNode)) 
+        ~LogSlotHandle()
         {
-            for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
+            if (idx >= 0)
+                log_slot_used[idx].store(false, std::memory_order_release);
+        }
+    };
+    static thread_local LogSlotHandle log_slot_handle;
+
+    static LogSlot* threadLogSlot()
+    {
+        int64_t& idx = log_slot_handle.idx;
+        while (idx < 0)
+        {
+            for (int64_t i = 0; i < MAX_LOG_SLOTS; i++)
             {
-                if (D_RO(leafNode)->bitmap.test(i))
-                    std::cout << "(" << D_RO(leafNode)->kv_pairs[i].key << " | " << 
-                                        D_RO(leafNode)->kv_pairs[i].value << ")" << ", ";
+                bool used = false;
+                if (!log_slot_used[i].load(std::memory_order_relaxed) && 
+                    log_slot_used[i].compare_exchange_strong(used, true))
+                {
+                    idx = i;
+                    break;
+                }
             }
-            std::cout << std::endl;
-            leafNode = D_RO(leafNode)->p_next;
+            if (idx < 0)    // more than MAX_LOG_SLOTS threads, wait for one to exit
+                std::this_thread::yield();
         }
+        return &log_slots[idx];
     }
 
-    static int constructLeafNode(PMEMobjpool *pop, void *ptr, void *arg)
+    void FPtree::recover()
     {
-        struct LeafNode *node = (struct LeafNode *)ptr;
-        struct argLeafNode *a = (struct argLeafNode *)arg;
+        for (uint64_t i = 0; i < MAX_LOG_SLOTS; i++)
+        {
+            recoverSplit(&log_slots[i].split);
+            recoverDelete(&log_slots[i].del);
+            recoverDeleteRange(&log_slots[i].range);
+        }
+        pmemPersist(log_slots, sizeof(LogSlot) * MAX_LOG_SLOTS);
+    }
 
-        node->isInnerNode = a->isInnerNode;
-        node->bitmap = a->bitmap;
+    void FPtree::saveSnapshot()
+    {
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        List* list = D_RW(ListHead);
+        if (!TOID_IS_NULL(list->snapshot))
+            POBJ_FREE(&list->snapshot);
+
+        std::vector<InnerNode*> nodes;
+        if (root != nullptr && root->isInnerNode)
+            nodes.push_back(reinterpret_cast<InnerNode*> (root));
+        for (size_t i = 0; i < nodes.size(); i++)
+            for (uint64_t j = 0; j <= nodes[i]->nKey; j++)
+                if (nodes[i]->p_children[j]->isInnerNode)
+                    nodes.push_back(reinterpret_cast<InnerNode*> (nodes[i]->p_children[j]));
+
+        size_t size = sizeof(InnerSnapshot) + nodes.size() * sizeof(SnapshotNode);
+        if (POBJ_ZALLOC(pop, &list->snapshot, struct InnerSnapshot, size) != 0)
+            return;     // no snapshot, the next open rebuilds
+        InnerSnapshot* snapshot = D_RW(list->snapshot);
+        snapshot->num_nodes = nodes.size();
+        if (root != nullptr && !root->isInnerNode)
+            snapshot->root_leaf = pmemobj_oid(root).off;
+        uint64_t next_child = 1;    // breadth first, so inner children are numbered in visiting order
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            SnapshotNode& entry = snapshot->nodes[i];
+            entry.leaf_children = !nodes[i]->p_children[0]->isInnerNode;
+            entry.nKey = nodes[i]->nKey;
+            std::copy(nodes[i]->keys, nodes[i]->keys + nodes[i]->nKey, entry.keys);
+            for (uint64_t j = 0; j <= nodes[i]->nKey; j++)
+                entry.children[j] = entry.leaf_children ? pmemobj_oid(nodes[i]->p_children[j]).off : next_child++;
+        }
+        pmemPersist(snapshot, size);
+
+        // the stamp goes last, a shutdown that does not get here leaves the snapshot invalid
+        snapshot->epoch = list->epoch;
+        pmemPersist(&snapshot->epoch, sizeof(uint64_t));
+    }
+
+    bool FPtree::loadSnapshot()
+    {
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        const List* list = D_RO(ListHead);
+        if (TOID_IS_NULL(list->snapshot) || D_RO(list->snapshot)->epoch != list->epoch)
+            return false;
+
+        const InnerSnapshot* snapshot = D_RO(list->snapshot);
+        PMEMoid oid = ListHead.oid;
+        auto leafAt = [&oid] (uint64_t off) {
+            oid.off = off;
+            return reinterpret_cast<BaseNode*> (pmemobj_direct(oid));
+        };
+        std::vector<InnerNode*> nodes(snapshot->num_nodes);
+        std::vector<BaseNode*> leaves;
+        for (InnerNode*& node : nodes)
+            node = new InnerNode();
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            const SnapshotNode& entry = snapshot->nodes[i];
+            nodes[i]->nKey = entry.nKey;
+            std::copy(entry.keys, entry.keys + entry.nKey, nodes[i]->keys);
+            for (uint64_t j = 0; j <= entry.nKey; j++)
+            {
+                if (entry.leaf_children)
+                    leaves.push_back(nodes[i]->p_children[j] = leafAt(entry.children[j]));
+                else
+                    nodes[i]->p_children[j] = nodes[entry.children[j]];
+            }
+        }
+
+        if (!nodes.empty())
+            root = nodes[0];
+        else if (snapshot->root_leaf != 0)
+            leaves.push_back(root = leafAt(snapshot->root_leaf));
+        else
+            root = nullptr;
+        unsigned num_threads = std::thread::hardware_concurrency();
+        // the fingerprints were persisted before the snapshot, the sorted slots are volatile
+        parallelFor(leaves.size(), num_threads, [&] (size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+                reinterpret_cast<LeafNode*> (leaves[i])->sortSlots();
+        });
+        rebuildLeafPool(leaves, num_threads);
+        return true;
+    }
+
+    void FPtree::pmemInit(const char* path_ptr, long long pool_size, bool lazy_rebuild)
+    {
+        List* list;
+        if (file_pool_exists(path_ptr) == 0) 
+        {
+            if ((pop = pmemobj_create(path_ptr, POBJ_LAYOUT_NAME(FPtree), pool_size, 0666)) == NULL) 
+            {
+                perror("failed to create pool\n");
+                return;
+            }
+            if (!registerLeafGroupClass())
+            {
+                pmemobj_close(pop);
+                pop = NULL;
+                return;
+            }
+            list = D_RW(POBJ_ROOT(pop, struct List));     // a new root object is zeroed
+            log_slots = list->logs;
+            resetLeafLocks();
+            std::lock_guard<std::mutex> guard(leaf_pool_lock);
+            leaf_pool.clear();          // free leaves of a pool opened before belong to that pool
+            leaf_cache.leaves.clear();
+        } 
+        else 
+        {
+            if ((pop = pmemobj_open(path_ptr, POBJ_LAYOUT_NAME(FPtree))) == NULL)
+            {
+                perror("failed to open pool\n");
+                return;
+            }
+            if (!registerLeafGroupClass())
+            {
+                pmemobj_close(pop);
+                pop = NULL;
+                return;
+            }
+            list = D_RW(POBJ_ROOT(pop, struct List));
+            log_slots = list->logs;
+            resetLeafLocks();
+            leaf_cache.leaves.clear();  // the pool may be rebuilt on another thread, drop leaves cached before a reopen
+            // a valid snapshot means the last shutdown was clean, so the logs are empty as well
+            if (!loadSnapshot())
+            {
+                recover();
+                if (lazy_rebuild && firstLeaf(list->head) != nullptr)
+                {
+                    uint64_t groups = D_RO(list->groups)->id + 1;
+                    sparse_index.reset(new SparseEntry[groups * LEAF_GROUP_SIZE / SPARSE_INDEX_STRIDE + 1]);
+                    sparse_size.store(0, std::memory_order_relaxed);
+                    // which leaves of these groups are free is known once the rebuild is done, splits
+                    // until then take their leaves from new groups
+                    rebuild_groups = groups;
+                    pending_splits.clear();
+                    {
+                        std::lock_guard<std::mutex> guard(leaf_pool_lock);
+                        leaf_pool.clear();
+                    }
+                    rebuilding.store(true, std::memory_order_release);
+                    rebuilder = std::thread(&FPtree::rebuildIndex, this);
+                }
+                else
+                    bulkLoad(1);
+            }
+        }
+        if (pop == NULL)
+            return;
+        list->epoch++;      // from here on the snapshot is stale, a crash falls back to a full rebuild
+        pmemPersist(&list->epoch, sizeof(uint64_t));
+    }
+
+#endif
+
+FPtree::FPtree() 
+{
+    root = nullptr;
+}
+
+
+FPtree::~FPtree() 
+{
+    #ifdef PMEM
+        if (rebuilder.joinable())
+            rebuilder.join();
+    #endif
+    Epoch::drain();
+    #ifdef PMEM
+        if (pop != NULL)
+        {
+            saveSnapshot();
+            pmemobj_close(pop);
+            pop = NULL;
+        }
+    #else
+        if (root != nullptr && root->isInnerNode)
+            delete reinterpret_cast<InnerNode*> (root);
+        else if (root != nullptr)
+            delete reinterpret_cast<LeafNode*> (root);
+    #endif  
+}
+
+
+inline static uint8_t getOneByteHash(uint64_t key)
+{
+    uint8_t oneByteHashKey = std::_Hash_bytes(&key, sizeof(key), 1) & 0xff;
+    return oneByteHashKey;
+}
+
+
+#ifdef PMEM
+    static void showList()
+    {
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        TOID(struct LeafNode) leafNode = D_RO(ListHead)->head;
+
+        while (!TOID_IS_NULL(leafNode)) 
+        {
+            for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
+            {
+                if (D_RO(leafNode)->bitmap.test(i))
+                    std::cout << "(" << D_RO(leafNode)->kv_pairs[i].key << " | " << 
+                                        D_RO(leafNode)->kv_pairs[i].value << ")" << ", ";
+            }
+            std::cout << std::endl;
+            leafNode = D_RO(leafNode)->p_next;
+        }
+    }
+
+    static int constructLeafNode(PMEMobjpool *pop, void *ptr, void *arg)
+    {
+        struct LeafNode *node = (struct LeafNode *)ptr;
+        struct argLeafNode *a = (struct argLeafNode *)arg;
+
+        node->isInnerNode = a->isInnerNode;
+        node->bitmap = a->bitmap;
         memcpy(node->fingerprints, a->fingerprints, sizeof(a->fingerprints));
         memcpy(node->kv_pairs, a->kv_pairs, sizeof(a->kv_pairs));
+        memcpy(node->sortedSlots(), a->sorted_slots, sizeof(a->sorted_slots));
         node->p_next = TOID_NULL(struct LeafNode);
-        node->lock = a->lock;
+        node->resetVersion(a->lock);
 
-        pmemobj_persist(pop, node, a->size);
+        pmemPersist(node, a->size);
 
         return 0;
     }
+
 #endif  
 
 
@@ -350,646 +1112,1635 @@ inline LeafNode* FPtree::findLeaf(uint64_t key)
     return reinterpret_cast<LeafNode*> (cursor);
 }
 
-inline LeafNode* FPtree::findLeafAndPushInnerNodes(uint64_t key)
+inline LeafNode* FPtree::findLeafAndUpperBound(uint64_t key, uint64_t& upper, bool& bounded)
 {
+    bounded = false;
     if (!root)
-	return nullptr;
-    stack_innerNodes.clear();
-    if (!root->isInnerNode) 
-    {
-    	stack_innerNodes.push(nullptr);
-        return reinterpret_cast<LeafNode*> (root);
-    }
-    InnerNode* cursor = reinterpret_cast<InnerNode*> (root);
+        return nullptr;
+    BaseNode* cursor = root;
+    uint64_t idx;
     while (cursor->isInnerNode)
     {
-        stack_innerNodes.push(cursor);
-        cursor = reinterpret_cast<InnerNode*> (cursor->p_children[cursor->findChildIndex(key)]);
+        InnerNode* inner = reinterpret_cast<InnerNode*> (cursor);
+        idx = inner->findChildIndex(key);
+        if (idx < inner->nKey)  // separators get tighter on the way down
+        {
+            upper = inner->keys[idx];
+            bounded = true;
+        }
+        cursor = inner->p_children[idx];
     }
     return reinterpret_cast<LeafNode*> (cursor);
 }
 
-
-uint64_t FPtree::find(uint64_t key)
+static inline void prefetchLeafHeader(LeafNode* leaf)
 {
-    LeafNode* pLeafNode;
-    volatile uint64_t idx;
-    tbb::speculative_spin_rw_mutex::scoped_lock lock_find;
-    while (true)
-    {
-        lock_find.acquire(speculative_lock, false);
-        if ((pLeafNode = findLeaf(key)) == nullptr) { lock_find.release(); break; }
-        if (pLeafNode->lock) { lock_find.release(); continue; }
-        idx = pLeafNode->findKVIndex(key);
-        lock_find.release();
-        return (idx != MAX_LEAF_SIZE ? pLeafNode->kv_pairs[idx].value : 0 );
-    }
-    return 0;
+    __builtin_prefetch(leaf->fingerprints);
+    __builtin_prefetch(&leaf->bitmap);
 }
 
 
-void FPtree::splitLeafAndUpdateInnerParents(LeafNode* reachedLeafNode, Result decision, struct KV kv, 
-                                            bool updateFunc = false, uint64_t prevPos = MAX_LEAF_SIZE)
-{
-    uint64_t splitKey;
-
-    #ifdef PMEM
-        TOID(struct LeafNode) insertNode = pmemobj_oid(reachedLeafNode);
-    #else
-        LeafNode* insertNode = reachedLeafNode;
-    #endif
+/*
+    Optimistic lock coupling (OLC): readers take no lock, they remember the version of every
+    node on the way down and validate it after reading the node. Leaf writers lock the leaf only,
+    structure modifications (SMOs) are serialized by smo_lock and write lock each inner node
+    before modifying it, so readers and writers elsewhere in the tree are not blocked.
+    Without OLC, the same roles are played by speculative_lock as reader and writer.
+*/
+#ifdef OLC
+    // inner nodes write locked by the current SMO of this thread, and whether they become obsolete
+    static thread_local std::vector<std::pair<InnerNode*, bool>> locked_inners;
 
-    if (decision == Result::Split)
+    LeafNode* FPtree::findLeafOptimistic(uint64_t key, uint64_t& leaf_version, uint64_t* upper, bool* bounded)
     {
-        splitKey = splitLeaf(reachedLeafNode);       // split and link two leaves
-        if (kv.key >= splitKey)                      // select one leaf to insert
-            insertNode = reachedLeafNode->p_next;
-    }
-
-    #ifdef PMEM
-        uint64_t slot = D_RW(insertNode)->bitmap.first_zero();
-        assert(slot < MAX_LEAF_SIZE && "Slot idx out of bound");
-        D_RW(insertNode)->kv_pairs[slot] = kv; 
-        D_RW(insertNode)->fingerprints[slot] = getOneByteHash(kv.key);
-        pmemobj_persist(pop, &D_RO(insertNode)->kv_pairs[slot], sizeof(struct KV));
-        pmemobj_persist(pop, &D_RO(insertNode)->fingerprints[slot], SIZE_ONE_BYTE_HASH);
-
-        if (!updateFunc)
+        BaseNode* node, *child;
+        InnerNode* inner;
+        uint64_t v, child_v, idx;
+    RESTART:
+        if (bounded)
+            *bounded = false;
+        if ((node = __atomic_load_n(&root, __ATOMIC_ACQUIRE)) == nullptr)
+            return nullptr;
+        if (node->isInnerNode)
         {
-            D_RW(insertNode)->bitmap.set(slot);
+            if (!reinterpret_cast<InnerNode*> (node)->readLock(v)) goto RESTART;
         }
-        else 
+        else if ((v = reinterpret_cast<LeafNode*> (node)->lockWord().load(std::memory_order_acquire)) & 1)
         {
-            Bitset tmpBitmap = D_RW(insertNode)->bitmap;
-            tmpBitmap.reset(prevPos); tmpBitmap.set(slot);
-            D_RW(insertNode)->bitmap = tmpBitmap;
+            _mm_pause(); goto RESTART;
         }
-        pmemobj_persist(pop, &D_RO(insertNode)->bitmap, sizeof(D_RO(insertNode)->bitmap));
-    #else
-        if (updateFunc)
-            insertNode->kv_pairs[prevPos].value = kv.value;
-        else
-            insertNode->addKV(kv);
-    #endif
+        if (node != __atomic_load_n(&root, __ATOMIC_ACQUIRE)) goto RESTART;    // root was split or merged
 
-    if (decision == Result::Split)
-    {   
-        LeafNode* newLeafNode;
-    #ifdef PMEM
-        newLeafNode = (struct LeafNode *) pmemobj_direct((reachedLeafNode->p_next).oid);
-    #else
-        newLeafNode = reachedLeafNode->p_next;
-    #endif
-        tbb::speculative_spin_rw_mutex::scoped_lock lock_split;
-        uint64_t mid = MAX_INNER_SIZE / 2, new_splitKey, insert_pos;
-        InnerNode* cur, *parent, *newInnerNode;
-        BaseNode* child;
-        short i = 0, idx;
-        /*---------------- Second Critical Section -----------------*/
-        lock_split.acquire(speculative_lock);
-        if (!root->isInnerNode) // splitting when tree has only root 
-        {
-            cur = new InnerNode();
-            cur->init(splitKey, reachedLeafNode, newLeafNode);
-            root = cur;
-        }
-        else // need to retraverse & update parent
+        while (node->isInnerNode)
         {
-            cur = reinterpret_cast<InnerNode*> (root);
-            while(cur->isInnerNode)
+            inner = reinterpret_cast<InnerNode*> (node);
+            idx = inner->findChildIndex(key);
+            if (bounded && idx < inner->nKey)
             {
-                inners[i] = cur;
-                idx = std::lower_bound(cur->keys, cur->keys + cur->nKey, kv.key) - cur->keys;
-                if (idx < cur->nKey && cur->keys[idx] == kv.key) // TODO: this should always be false
-                    idx ++;
-                ppos[i++] = idx;
-                cur = reinterpret_cast<InnerNode*> (cur->p_children[idx]);
+                *upper = inner->keys[idx];
+                *bounded = true;
             }
-            parent = inners[--i];
-            child = newLeafNode;
-            while (true)
+            child = inner->p_children[idx];
+            if (!inner->validate(v)) goto RESTART;     // child pointer may be garbage otherwise
+            if (child->isInnerNode)
             {
-                insert_pos = ppos[i--];
-                if (parent->nKey < MAX_INNER_SIZE)
-                {
-                    parent->addKey(insert_pos, splitKey, child);
-                    break;
-                }
-                else 
-                {
-                    newInnerNode = new InnerNode();
-                    parent->nKey = mid;
-                    if (insert_pos != mid)
-                    {
-                        new_splitKey = parent->keys[mid];
-                        std::copy(parent->keys + mid + 1, parent->keys + MAX_INNER_SIZE, newInnerNode->keys);
-                        std::copy(parent->p_children + mid + 1, parent->p_children + MAX_INNER_SIZE + 1, newInnerNode->p_children);
-                        newInnerNode->nKey = MAX_INNER_SIZE - mid - 1;
-                        if (insert_pos < mid)
-                            parent->addKey(insert_pos, splitKey, child);
-                        else
-                            newInnerNode->addKey(insert_pos - mid - 1, splitKey, child);
-                    }
-                    else 
-                    {
-                        new_splitKey = splitKey;
-                        std::copy(parent->keys + mid, parent->keys + MAX_INNER_SIZE, newInnerNode->keys);
-                        std::copy(parent->p_children + mid, parent->p_children + MAX_INNER_SIZE + 1, newInnerNode->p_children);
-                        newInnerNode->p_children[0] = child;
-                        newInnerNode->nKey = MAX_INNER_SIZE - mid;
-                    }
-                    splitKey = new_splitKey;
-                    if (parent == root)
-                    {
-                        cur = new InnerNode(splitKey, parent, newInnerNode);
-                        root = cur;
-                        break;
-                    }
-                    parent = inners[i];
-                    child = newInnerNode;
-                }
+                if (!reinterpret_cast<InnerNode*> (child)->readLock(child_v)) goto RESTART;
             }
+            else if ((child_v = reinterpret_cast<LeafNode*> (child)->lockWord().load(std::memory_order_acquire)) & 1)
+            {
+                _mm_pause(); goto RESTART;
+            }
+            if (!inner->validate(v)) goto RESTART;
+            node = child;
+            v = child_v;
         }
-        newLeafNode->Unlock();
-        lock_split.release();
-        /*---------------- End of Second Critical Section -----------------*/
+        leaf_version = v;
+        return reinterpret_cast<LeafNode*> (node);
     }
-}
 
+    inline bool FPtree::validateLeaf(LeafNode* leaf, uint64_t leaf_version)
+    {
+        // leaf held key when its version was read, and its key range only shrinks by a split or a removal,
+        // both under its lock. A removed leaf is retired to Epoch, so it is not reused while we look at it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return leaf->lockWord().load(std::memory_order_relaxed) == leaf_version;
+    }
+#endif
 
-void FPtree::updateParents(uint64_t splitKey, InnerNode* parent, BaseNode* child) 
+LeafNode* FPtree::lockLeaf(uint64_t key, uint64_t& upper, bool& bounded)
 {
-    uint64_t mid = floor(MAX_INNER_SIZE / 2);
-    uint64_t new_splitKey, insert_pos;
-    while (true)
-    {
-        if (parent->nKey < MAX_INNER_SIZE)
+    LeafNode* leaf;
+    #ifdef PMEM
+        if (rebuilding.load(std::memory_order_acquire) && (leaf = lockLeafLazy(key, upper, bounded)) != nullptr)
+            return leaf;
+    #endif
+    #ifdef OLC
+        uint64_t v;
+        while (true)
         {
-            insert_pos = parent->findChildIndex(splitKey);
-            parent->addKey(insert_pos, splitKey, child);
-            return;
+            if ((leaf = findLeafOptimistic(key, v, &upper, &bounded)) == nullptr)
+                return nullptr;
+            // the lock succeeds only if leaf has not changed since it was found, as validateLeaf would check
+            if (!leaf->lockWord().compare_exchange_strong(v, v + 1))
+                continue;
+            return leaf;
         }
-        else 
+    #else
+        tbb::speculative_spin_rw_mutex::scoped_lock lock_leaf;
+        while (true)
         {
-            InnerNode* newInnerNode = new InnerNode();
-            insert_pos = std::lower_bound(parent->keys, parent->keys + MAX_INNER_SIZE, splitKey) - parent->keys;
+            /*---------------- Critical Section -----------------*/
+            lock_leaf.acquire(speculative_lock, false);
+            if ((leaf = findLeafAndUpperBound(key, upper, bounded)) == nullptr) { lock_leaf.release(); return nullptr; }
+            if (!leaf->Lock()) { lock_leaf.release(); continue; }
+            lock_leaf.release();
+            /*---------------- End of Critical Section -----------------*/
+            return leaf;
+        }
+    #endif
+}
 
-            if (insert_pos < mid) {  // insert into parent node
-                new_splitKey = parent->keys[mid];
-                parent->nKey = mid;
-                std::memmove(newInnerNode->keys, parent->keys + mid + 1, (MAX_INNER_SIZE - mid - 1)*sizeof(uint64_t));
-                std::memmove(newInnerNode->p_children, parent->p_children + mid + 1, (MAX_INNER_SIZE - mid)*sizeof(BaseNode*));
-                newInnerNode->nKey = MAX_INNER_SIZE - mid - 1;
-                parent->addKey(insert_pos, splitKey, child);
-            }
-            else if (insert_pos > mid) {  // insert into new innernode
-                new_splitKey = parent->keys[mid];
-                parent->nKey = mid;
-                std::memmove(newInnerNode->keys, parent->keys + mid + 1, (MAX_INNER_SIZE - mid - 1)*sizeof(uint64_t));
-                std::memmove(newInnerNode->p_children, parent->p_children + mid + 1, (MAX_INNER_SIZE - mid)*sizeof(BaseNode*));
-                newInnerNode->nKey = MAX_INNER_SIZE - mid - 1;
-                newInnerNode->addKey(insert_pos - mid - 1, splitKey, child);
-            }
-            else {  // only insert child to new innernode, splitkey does not change
-                new_splitKey = splitKey;
-                parent->nKey = mid;
-                std::memmove(newInnerNode->keys, parent->keys + mid, (MAX_INNER_SIZE - mid)*sizeof(uint64_t));
-                std::memmove(newInnerNode->p_children, parent->p_children + mid, (MAX_INNER_SIZE - mid + 1)*sizeof(BaseNode*));
-                newInnerNode->p_children[0] = child;
-                newInnerNode->nKey = MAX_INNER_SIZE - mid;
-            }
+static void deleteInner(void* node)
+{
+    reinterpret_cast<InnerNode*> (node)->nKey = 0;  // children were moved to other nodes
+    delete reinterpret_cast<InnerNode*> (node);
+}
 
-            splitKey = new_splitKey;
+// inner nodes freed by the current SMO of this thread, retired only once the SMO is released
+// so that the HTM writer section does not touch the epoch records
+static thread_local std::vector<InnerNode*> pending_inners;
 
-            if (parent == root)
-            {
-                root = new InnerNode(splitKey, parent, newInnerNode);
-                return;
-            }
-            parent = stack_innerNodes.pop();
-            child = newInnerNode;
-        }
-    }
+inline void FPtree::acquireSMO([[maybe_unused]] tbb::speculative_spin_rw_mutex::scoped_lock& lock)
+{
+    #ifdef PMEM
+        awaitIndex();   // no inner nodes to modify before the lazy rebuild is done
+    #endif
+    #ifdef OLC
+        smo_lock.lock();
+    #else
+        lock.acquire(speculative_lock, true);
+    #endif
 }
 
-
-bool FPtree::update(struct KV kv)
+inline void FPtree::releaseSMO([[maybe_unused]] tbb::speculative_spin_rw_mutex::scoped_lock& lock)
 {
-    tbb::speculative_spin_rw_mutex::scoped_lock lock_update;
-    LeafNode* reachedLeafNode;
-    volatile uint64_t prevPos;
-    volatile Result decision = Result::Abort;
-    while (decision == Result::Abort)
-    {
-        lock_update.acquire(speculative_lock, false);
-        if ((reachedLeafNode = findLeaf(kv.key)) == nullptr) { lock_update.release(); return false; }
-        if (!reachedLeafNode->Lock()) { lock_update.release(); continue; }
-        prevPos = reachedLeafNode->findKVIndex(kv.key);
-        if (prevPos == MAX_LEAF_SIZE) // key not found
+    #ifdef OLC
+        for (auto& locked : locked_inners)
         {
-            reachedLeafNode->Unlock();
-            lock_update.release();
-            return false;
+            if (locked.second)
+                locked.first->writeUnlockObsolete();
+            else
+                locked.first->writeUnlock();
         }
-        decision = reachedLeafNode->isFull() ? Result::Split : Result::Update;
-        lock_update.release();
-    }
+        locked_inners.clear();
+        smo_lock.unlock();
+    #else
+        lock.release();
+    #endif
+    for (InnerNode* node : pending_inners)
+        Epoch::retire(node, deleteInner);
+    pending_inners.clear();
+}
 
-    splitLeafAndUpdateInnerParents(reachedLeafNode, decision, kv, true, prevPos);
+inline void FPtree::lockInner([[maybe_unused]] InnerNode* node)
+{
+    #ifdef OLC
+        // SMOs are serialized, so a locked node is already locked by this SMO
+        if (node->version.load(std::memory_order_relaxed) & 2)
+            return;
+        node->writeLock();
+        locked_inners.push_back(std::make_pair(node, false));
+    #endif
+}
 
-    reachedLeafNode->Unlock();
-    
-    return true;
+static void deleteLeaf(void* leaf)
+{
+    #ifdef PMEM
+        freeLeaf(reinterpret_cast<LeafNode*> (leaf));
+    #else
+        delete reinterpret_cast<LeafNode*> (leaf);
+    #endif
+}
+
+inline void FPtree::freeInner(InnerNode* node)
+{
+    #ifdef OLC
+        lockInner(node);
+        for (auto& locked : locked_inners)
+            if (locked.first == node)
+                locked.second = true;
+    #endif
+    pending_inners.push_back(node);
 }
 
 
-bool FPtree::insert(struct KV kv) 
+uint64_t FPtree::find(uint64_t key)
 {
-    tbb::speculative_spin_rw_mutex::scoped_lock lock_insert;
-    if (!root)  // if tree is empty
-    {
-        lock_insert.acquire(speculative_lock, true);
-        if (!root)
+    EpochGuard epoch_guard;
+    uint64_t value;
+    #ifdef PMEM
+        LeafNode* pLeafNode;
+        uint64_t upper, idx;
+        bool bounded;
+        if (rebuilding.load(std::memory_order_acquire) && (pLeafNode = lockLeafLazy(key, upper, bounded)) != nullptr)
         {
-            #ifdef PMEM
-                struct argLeafNode args(kv);
-                TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
-                TOID(struct LeafNode) *dst = &D_RW(ListHead)->head;
-                POBJ_ALLOC(pop, dst, struct LeafNode, args.size, constructLeafNode, &args);
-                D_RW(ListHead)->head = *dst; 
-                pmemobj_persist(pop, &D_RO(ListHead)->head, sizeof(D_RO(ListHead)->head));
-                root = (struct BaseNode *) pmemobj_direct((*dst).oid);
-            #else
-                root = new LeafNode();
-                reinterpret_cast<LeafNode*>(root)->lock = 1;
-                reinterpret_cast<LeafNode*> (root)->addKV(kv);
-                reinterpret_cast<LeafNode*>(root)->lock = 0;
-            #endif
-            lock_insert.release();
-            return true;
+            idx = pLeafNode->findKVIndex(key);
+            value = idx != MAX_LEAF_SIZE ? pLeafNode->kv_pairs[idx].value : 0;
+            pLeafNode->Unlock();
+            return value;
         }
-        lock_insert.release();
-    }
-
-    Result decision = Result::Abort;
-    InnerNode* cursor;
-    LeafNode* reachedLeafNode;
-    uint64_t nKey;
-    int idx;
-    /*---------------- First Critical Section -----------------*/
-    {
-    TBB_BEGIN:
-        lock_insert.acquire(speculative_lock, false);
-        reachedLeafNode = findLeaf(kv.key);
-        if (!reachedLeafNode->Lock()) 
-        { 
-            lock_insert.release(); 
-            goto TBB_BEGIN;
-        }
-        idx = reachedLeafNode->findKVIndex(kv.key);
-        if (idx != MAX_LEAF_SIZE)
-            reachedLeafNode->Unlock();
-        else
-            decision = reachedLeafNode->isFull() ? Result::Split : Result::Insert;
-        lock_insert.release();
-    }
-    /*---------------- End of First Critical Section -----------------*/
-
-    if (decision == Result::Abort)  // kv already exists
-        return false;
-
-    splitLeafAndUpdateInnerParents(reachedLeafNode, decision, kv);
-
-    reachedLeafNode->Unlock();
-    
-    return true;
+    #endif
+    // a single lookup is the interleaved engine with one lookup in flight
+    lookupInterleaved(&key, 1, &value, 1);
+    return value;
 }
 
 
-
-uint64_t FPtree::splitLeaf(LeafNode* leaf)
+void FPtree::findBatch(const uint64_t* keys, size_t n, uint64_t* out)
 {
-    uint64_t splitKey = findSplitKey(leaf);
+    EpochGuard epoch_guard;
+    if (n == 0)
+        return;
     #ifdef PMEM
-        TOID(struct LeafNode) *dst = &(leaf->p_next);
-        TOID(struct LeafNode) nextLeafNode = leaf->p_next;
-
-        // Get uLog from splitLogQueue
-        Log* log;
-        if (!splitLogQueue.pop(log)) { assert("Split log queue pop error!"); }
-
-        //set uLog.PCurrentLeaf to persistent address of Leaf
-        log->PCurrentLeaf = pmemobj_oid(leaf);
-        pmemobj_persist(pop, &(log->PCurrentLeaf), SIZE_PMEM_POINTER);
-
-        // Copy the content of Leaf into NewLeaf
-        struct argLeafNode args(leaf);
-
-        log->PLeaf = *dst;
-
-        POBJ_ALLOC(pop, dst, struct LeafNode, args.size, constructLeafNode, &args);
-
-        for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
+        if (rebuilding.load(std::memory_order_acquire))     // no inner nodes yet, look keys up one by one
         {
-            if (D_RO(*dst)->kv_pairs[i].key < splitKey)
-                D_RW(*dst)->bitmap.reset(i);
+            for (size_t i = 0; i < n; i++)
+                out[i] = find(keys[i]);
+            return;
         }
-        // Persist(NewLeaf.Bitmap)
-        pmemobj_persist(pop, &D_RO(*dst)->bitmap, sizeof(D_RO(*dst)->bitmap));
-
-        // Leaf.Bitmap = inverse(NewLeaf.Bitmap)
-        leaf->bitmap = D_RO(*dst)->bitmap;
-        if constexpr (MAX_LEAF_SIZE != 1)  leaf->bitmap.flip();
-
-        // Persist(Leaf.Bitmap)
-        pmemobj_persist(pop, &leaf->bitmap, sizeof(leaf->bitmap));
-
-        // Persist(Leaf.Next)
-        D_RW(*dst)->p_next = nextLeafNode;
-        pmemobj_persist(pop, &D_RO(*dst)->p_next, sizeof(D_RO(*dst)->p_next));
-
-        // reset uLog
-        log->PCurrentLeaf = OID_NULL;
-        log->PLeaf = OID_NULL;
-        pmemobj_persist(pop, &(log->PCurrentLeaf), SIZE_PMEM_POINTER);
-        pmemobj_persist(pop, &(log->PLeaf), SIZE_PMEM_POINTER);
-        splitLogQueue.push(log);
+    #endif
+    // visit keys in sorted order so that keys falling into the same leaf share one traversal
+    std::vector<std::pair<uint64_t, size_t>> batch(n);
+    for (size_t i = 0; i < n; i++)
+        batch[i] = std::make_pair(keys[i], i);
+    std::sort(batch.begin(), batch.end());
+    std::vector<uint64_t> candidates(n);
+
+    LeafNode* leaf, *next_leaf = nullptr;
+    uint64_t upper = 0, next_upper = 0;
+    bool bounded, next_bounded = false;
+    size_t i = 0, j, k;
+    uint64_t idx;
+    #ifdef OLC
+        uint64_t v, next_v = 0;
+        leaf = findLeafOptimistic(batch[0].first, v, &upper, &bounded);
     #else
-        LeafNode* newLeafNode = new LeafNode(*leaf);
+        // each leaf group is probed in its own reader window as in find, a leaf found in the previous
+        // window is reused only if its lock word has not moved since
+        tbb::speculative_spin_rw_mutex::scoped_lock lock_find;
+        uint64_t v, next_v = 0;
+        lock_find.acquire(speculative_lock, false);
+        leaf = findLeafAndUpperBound(batch[0].first, upper, bounded);
+        v = leaf ? leaf->lockWord().load(std::memory_order_acquire) : 0;
+    #endif
+    while (i < n)
+    {
+        if (leaf == nullptr)    // empty tree
+        {
+            for (; i < n; i++)
+                out[batch[i].second] = 0;
+            #ifndef OLC
+                lock_find.release();
+            #endif
+            break;
+        }
+        for (j = i; j < n && (!bounded || batch[j].first < upper); j++);
 
-        for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
+        // descend for the next group before probing this one, so the next leaf is in flight meanwhile
+        if (j < n)
         {
-            if (newLeafNode->kv_pairs[i].key < splitKey)
-                newLeafNode->bitmap.reset(i);
+            #ifdef OLC
+                next_leaf = findLeafOptimistic(batch[j].first, next_v, &next_upper, &next_bounded);
+                if (next_leaf)
+                    prefetchLeafHeader(next_leaf);
+            #else
+                next_leaf = findLeafAndUpperBound(batch[j].first, next_upper, next_bounded);
+                if (next_leaf)
+                {
+                    next_v = next_leaf->lockWord().load(std::memory_order_acquire);
+                    prefetchLeafHeader(next_leaf);
+                }
+            #endif
         }
 
-        leaf->bitmap = newLeafNode->bitmap;
-        leaf->bitmap.flip();
-        leaf->p_next = newLeafNode;
-    #endif
- 
-    return splitKey;
+        #ifndef OLC
+            // leaf is being modified or changed since it was found, retry this group as find does
+            if ((v & 1) || leaf->lockWord().load(std::memory_order_acquire) != v)
+            {
+                lock_find.release();
+                lock_find.acquire(speculative_lock, false);
+                leaf = findLeafAndUpperBound(batch[i].first, upper, bounded);
+                v = leaf ? leaf->lockWord().load(std::memory_order_acquire) : 0;
+                continue;
+            }
+        #endif
+        // probe all fingerprints first so that kv lines of all keys in the group are fetched in parallel
+        for (k = i; k < j; k++)
+        {
+            candidates[k] = leaf->matchFingerprints(batch[k].first);
+            if (candidates[k])
+                __builtin_prefetch(&leaf->kv_pairs[__builtin_ctzll(candidates[k])]);
+        }
+        for (k = i; k < j; k++)
+        {
+            idx = leaf->findKVIndex(batch[k].first, candidates[k]);
+            out[batch[k].second] = idx != MAX_LEAF_SIZE ? leaf->kv_pairs[idx].value : 0;
+        }
+        #ifdef OLC
+            if (!validateLeaf(leaf, v))   // leaf changed, retry this group
+            {
+                leaf = findLeafOptimistic(batch[i].first, v, &upper, &bounded);
+                continue;
+            }
+        #else
+            lock_find.release();
+            if (j < n)
+                lock_find.acquire(speculative_lock, false);
+        #endif
+        leaf = next_leaf; upper = next_upper; bounded = next_bounded; v = next_v;
+        i = j;
+    }
 }
 
 
-uint64_t FPtree::findSplitKey(LeafNode* leaf)
+/*
+    AMAC-style interleaved lookups: every in-flight lookup is a small state machine
+    that issues a prefetch for the next node it needs and then yields to the next
+    lookup, so up to group_size independent node misses are outstanding at once.
+*/
+struct LookupState
 {
-    KV tempArr[MAX_LEAF_SIZE];
-    memcpy(tempArr, leaf->kv_pairs, sizeof(leaf->kv_pairs));
-    // TODO: find median in one pass instead of sorting
-    std::sort(std::begin(tempArr), std::end(tempArr), [] (const KV& kv1, const KV& kv2)
-    {
-        return kv1.key < kv2.key;
-    });
-
-    uint64_t mid = floor(MAX_LEAF_SIZE / 2);
-    uint64_t splitKey = tempArr[mid].key;
+    enum Stage { Traverse, Compare, Idle };
+
+    Stage stage;
+    size_t pos;             // index of key in keys and out
+    BaseNode* node;
+    uint64_t candidates;    // fingerprint matches in leaf, valid in Compare stage
+    #ifdef OLC
+        InnerNode* parent;      // parent of node, nullptr if node is root
+        uint64_t parent_version;
+        uint64_t version;       // version of node once it is a leaf
+    #endif
+};
 
-    return splitKey;
+// first three lines: header and first keys of an inner node, or header, fingerprints and bitmap of a leaf
+static inline void prefetchNode(BaseNode* node)
+{
+    __builtin_prefetch(node);
+    __builtin_prefetch(reinterpret_cast<char*> (node) + 64);
+    __builtin_prefetch(reinterpret_cast<char*> (node) + 128);
 }
 
+void FPtree::findInterleaved(const uint64_t* keys, size_t n, uint64_t* out, size_t group_size)
+{
+    EpochGuard epoch_guard;
+    if (n == 0)
+        return;
+    #ifdef PMEM
+        if (rebuilding.load(std::memory_order_acquire))     // no inner nodes yet, look keys up one by one
+        {
+            for (size_t i = 0; i < n; i++)
+                out[i] = find(keys[i]);
+            return;
+        }
+    #endif
+    lookupInterleaved(keys, n, out, group_size);
+}
 
-#ifdef PMEM
-    void FPtree::recoverSplit(Log* uLog)
+void FPtree::lookupInterleaved(const uint64_t* keys, size_t n, uint64_t* out, size_t group_size)
+{
+    // kept per thread so that find, the group of one, does not allocate
+    static thread_local std::vector<LookupState> states;
+    states.resize(std::min(std::max(group_size, (size_t)1), n));
+    LeafNode* leaf;
+    InnerNode* inner;
+    uint64_t idx;
+    size_t next = 0, done = 0;
+#ifdef OLC
+    // every lookup validates on its own and restarts alone from root when a node changed under it
+    BaseNode* child;
+    uint64_t v, value;
+    bool empty = false;
+    auto start = [&] (LookupState& s)
     {
-        if (TOID_IS_NULL(uLog->PCurrentLeaf))
+        s.parent = nullptr;
+        s.node = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+        if (s.node)
         {
-            return;
+            s.stage = LookupState::Traverse;
+            prefetchNode(s.node);
         }
-        
-        if (TOID_IS_NULL(uLog->PLeaf))
+        else    // tree became empty, all remaining lookups return 0
         {
-            uLog->PCurrentLeaf = OID_NULL;
-            uLog->PLeaf = OID_NULL;
-            return;
+            out[s.pos] = 0;
+            s.stage = LookupState::Idle;
+            empty = true;
         }
-        else
+    };
+    auto finish = [&] (LookupState& s)
+    {
+        done++;
+        s.stage = LookupState::Idle;
+        if (next < n)
         {
-            LeafNode* leaf = (struct LeafNode *) pmemobj_direct((uLog->PCurrentLeaf).oid);
-            uint64_t splitKey = findSplitKey(leaf);
-            if (leaf->isFull())  // Crashed before inverse the current leaf 
-            {
-                for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
-                {
-                    if (D_RO(uLog->PLeaf)->kv_pairs[i].key < splitKey)
-                        D_RW(uLog->PLeaf)->bitmap.reset(i);
-                }
-                // Persist(NewLeaf.Bitmap)
-                pmemobj_persist(pop, &D_RO(uLog->PLeaf)->bitmap, sizeof(D_RO(uLog->PLeaf)->bitmap));
-
-                // Leaf.Bitmap = inverse(NewLeaf.Bitmap)
-                D_RW(uLog->PCurrentLeaf)->bitmap = D_RO(uLog->PLeaf)->bitmap;
-                if constexpr (MAX_LEAF_SIZE != 1)  D_RW(uLog->PCurrentLeaf)->bitmap.flip();
-
-                // Persist(Leaf.Bitmap)
-                pmemobj_persist(pop, &D_RO(uLog->PCurrentLeaf)->bitmap, sizeof(D_RO(uLog->PCurrentLeaf)->bitmap));
-
-                // Persist(Leaf.Next)
-                D_RW(uLog->PCurrentLeaf)->p_next = uLog->PLeaf;
-                pmemobj_persist(pop, &D_RO(uLog->PLeaf)->p_next, sizeof(D_RO(uLog->PLeaf)->p_next));
-
-                // reset uLog
-                uLog->PCurrentLeaf = OID_NULL;
-                uLog->PLeaf = OID_NULL;
-                return;
-            }
-            else    // Crashed after inverse the current leaf 
-            {
-                // Leaf.Bitmap = inverse(NewLeaf.Bitmap)
-                if constexpr (MAX_LEAF_SIZE != 1)  D_RW(uLog->PCurrentLeaf)->bitmap.flip();
-    
-                // Persist(Leaf.Bitmap)
-                pmemobj_persist(pop, &D_RO(uLog->PCurrentLeaf)->bitmap, sizeof(D_RO(uLog->PCurrentLeaf)->bitmap));
-
-                // Persist(Leaf.Next)
-                D_RW(uLog->PCurrentLeaf)->p_next = uLog->PLeaf;
-                pmemobj_persist(pop, &D_RO(uLog->PLeaf)->p_next, sizeof(D_RO(uLog->PLeaf)->p_next));
-
-                // reset uLog
-                uLog->PCurrentLeaf = OID_NULL;
-                uLog->PLeaf = OID_NULL;
-                return;
-            }
+            s.pos = next++;
+            start(s);
         }
-    }
-#endif
-
-void FPtree::removeLeafAndMergeInnerNodes(short i, short indexNode_level)
-{
-    InnerNode* temp, *left, *right, *parent = inners[i];
-    uint64_t left_idx, new_key = 0, child_idx = ppos[i];
-
-    if (child_idx == 0)
+    };
+    for (auto& s : states)
     {
-        new_key = parent->keys[0];
-        parent->removeKey(child_idx, false);
-        if (indexNode_level >= 0 && inners[indexNode_level] != parent)
-            inners[indexNode_level]->keys[ppos[indexNode_level] - 1] = new_key;
+        s.stage = LookupState::Idle;
+        if (next < n)
+        {
+            s.pos = next++;
+            start(s);
+        }
     }
-    else
-        parent->removeKey(child_idx - 1, true);
-
-    while (!parent->nKey) // parent has no key, merge with sibling
+    while (done < n)
     {
-        if (parent == root) // entire tree stores 1 kv, convert the only leafnode into root
+        if (empty)
         {
-            temp = reinterpret_cast<InnerNode*> (root);
-            root = parent->p_children[0];
-            delete temp;
-            break;         
+            for (auto& t : states)
+                if (t.stage != LookupState::Idle)
+                    out[t.pos] = 0;
+            std::fill(out + next, out + n, 0);
+            return;
         }
-        parent = inners[--i];
-        child_idx = ppos[i];
-        left_idx = child_idx;
-        if (!(child_idx != 0 && tryBorrowKey(parent, child_idx, child_idx-1)) && 
-            !(child_idx != parent->nKey && tryBorrowKey(parent, child_idx, child_idx+1))) // if cannot borrow from any siblings
+        for (auto& s : states)
         {
-            if (left_idx != 0)
-                left_idx --;
-            left = reinterpret_cast<InnerNode*> (parent->p_children[left_idx]);
-            right = reinterpret_cast<InnerNode*> (parent->p_children[left_idx + 1]);
-
-            if (left->nKey == 0)
+            if (s.stage == LookupState::Traverse)
             {
-                right->addKey(0, parent->keys[left_idx], left->p_children[0], false);
-                delete left;
-                parent->removeKey(left_idx, false);
+                // node was prefetched in the previous round: read its version, then validate
+                // the parent to make sure the pointer we followed was still current
+                if (s.node->isInnerNode)
+                {
+                    inner = reinterpret_cast<InnerNode*> (s.node);
+                    if (!inner->readLock(v)) { start(s); continue; }
+                }
+                else if ((v = reinterpret_cast<LeafNode*> (s.node)->lockWord().load(std::memory_order_acquire)) & 1)
+                {
+                    start(s); continue;
+                }
+                if (s.parent ? !s.parent->validate(s.parent_version) : s.node != __atomic_load_n(&root, __ATOMIC_ACQUIRE))
+                {
+                    start(s); continue;
+                }
+                if (s.node->isInnerNode)
+                {
+                    inner = reinterpret_cast<InnerNode*> (s.node);
+                    child = inner->p_children[inner->findChildIndex(keys[s.pos])];
+                    s.parent = inner;
+                    s.parent_version = v;
+                    s.node = child;
+                    prefetchNode(s.node);
+                    continue;
+                }
+                leaf = reinterpret_cast<LeafNode*> (s.node);
+                s.version = v;
+                s.candidates = leaf->matchFingerprints(keys[s.pos]);
+                if (s.candidates)
+                {
+                    __builtin_prefetch(&leaf->kv_pairs[__builtin_ctzll(s.candidates)]);
+                    s.stage = LookupState::Compare;
+                    continue;
+                }
+                if (!validateLeaf(leaf, s.version)) { start(s); continue; }
+                out[s.pos] = 0;
+                finish(s);
             }
-            else
+            else if (s.stage == LookupState::Compare)
             {
-                left->addKey(left->nKey, parent->keys[left_idx], right->p_children[0]);
-                delete right;
-                parent->removeKey(left_idx);
+                leaf = reinterpret_cast<LeafNode*> (s.node);
+                idx = leaf->findKVIndex(keys[s.pos], s.candidates);
+                value = idx != MAX_LEAF_SIZE ? leaf->kv_pairs[idx].value : 0;
+                if (!validateLeaf(leaf, s.version)) { start(s); continue; }
+                out[s.pos] = value;
+                finish(s);
             }
         }
-        else
-            break;
     }
-}
-
-bool FPtree::deleteKey(uint64_t key)
-{
-    LeafNode* leaf, *sibling;
-    InnerNode *parent, *cur; 
-    tbb::speculative_spin_rw_mutex::scoped_lock lock_delete;
-    Result decision = Result::Abort;
-    LeafNodeStat lstat;
-    short i, idx, indexNode_level, sib_level;
-    while (decision == Result::Abort) 
+#else
+    // one reader window per group of lookups: all of them start and finish inside it, so the window
+    // is as small as findBatch's and no node pointer outlives the window it was read in
+    tbb::speculative_spin_rw_mutex::scoped_lock lock_find;
+    size_t active;
+    auto finish = [&] (LookupState& s)
     {
-        i = 0; indexNode_level = -1, sib_level = -1;
-        sibling = nullptr; 
-        /*---------------- Critical Section -----------------*/
-        lock_delete.acquire(speculative_lock, true);
-
-        if (!root) { lock_delete.release(); return false;} // empty tree
-        cur = reinterpret_cast<InnerNode*> (root);
-        while (cur->isInnerNode)
-        {
-            inners[i] = cur;
-            idx = std::lower_bound(cur->keys, cur->keys + cur->nKey, key) - cur->keys;
-            if (idx < cur->nKey && cur->keys[idx] == key) // just found index node
-            {
-                indexNode_level = i;
-                idx ++;
-            }
-            if (idx != 0)
-                sib_level = i;
-            ppos[i++] = idx;
-            cur = reinterpret_cast<InnerNode*> (cur->p_children[idx]);
-        }
-        parent = inners[--i];
-        leaf = reinterpret_cast<LeafNode*> (cur);
-
-        if (!leaf->Lock()) { lock_delete.release(); continue; }
-        leaf->getStat(key, lstat);
-        if (lstat.kv_idx == MAX_LEAF_SIZE) // key not found
+        done++;
+        active--;
+        s.stage = LookupState::Idle;
+    };
+    while (next < n)
+    {
+        lock_find.acquire(speculative_lock, false);
+        if (!root)
         {
-            decision = Result::NotFound;
-            leaf->Unlock();
+            lock_find.release();
+            std::fill(out + next, out + n, 0);
+            return;
         }
-        else if (lstat.count > 1)   // leaf contains key and other keys
+        active = 0;
+        for (auto& s : states)
         {
-            if (indexNode_level >= 0) // key appears in an inner node, need to replace
-                inners[indexNode_level]->keys[ppos[indexNode_level] - 1] = lstat.min_key;
-            decision = Result::Remove;
+            s.stage = LookupState::Idle;
+            if (next < n)
+            {
+                s.stage = LookupState::Traverse;
+                s.pos = next++;
+                s.node = root;
+                active++;
+            }
         }
-        else // leaf contains key only
+        while (active)
         {
-            if (parent) // try lock left sibling if exist, then remove leaf from parent and update inner nodes
+            for (auto& s : states)
             {
-                if (sib_level >= 0)   // left sibling exists
+                if (s.stage == LookupState::Traverse)
                 {
-                    cur = reinterpret_cast<InnerNode*> (inners[sib_level]->p_children[ppos[sib_level] - 1]);
-                    while (cur->isInnerNode)
-                        cur = reinterpret_cast<InnerNode*> (cur->p_children[cur->nKey]);
-                    sibling = reinterpret_cast<LeafNode*> (cur);
-                    if (!sibling->Lock())
+                    if (s.node->isInnerNode)
+                    {
+                        inner = reinterpret_cast<InnerNode*> (s.node);
+                        s.node = inner->p_children[inner->findChildIndex(keys[s.pos])];
+                        prefetchNode(s.node);
+                        continue;
+                    }
+                    leaf = reinterpret_cast<LeafNode*> (s.node);
+                    if (leaf->isLocked())   // leaf is being modified, node pointers may go stale once we release, restart the group
                     {
-                        lock_delete.release(); leaf->Unlock(); continue;
+                        lock_find.release();
+                        lock_find.acquire(speculative_lock, false);
+                        if (!root)
+                        {
+                            for (auto& t : states)
+                                if (t.stage != LookupState::Idle)
+                                    out[t.pos] = 0;
+                            std::fill(out + next, out + n, 0);
+                            lock_find.release();
+                            return;
+                        }
+                        for (auto& t : states)
+                            if (t.stage != LookupState::Idle)
+                            {
+                                t.stage = LookupState::Traverse;
+                                t.node = root;
+                            }
+                        break;
+                    }
+                    s.candidates = leaf->matchFingerprints(keys[s.pos]);
+                    if (s.candidates)
+                    {
+                        __builtin_prefetch(&leaf->kv_pairs[__builtin_ctzll(s.candidates)]);
+                        s.stage = LookupState::Compare;
+                        continue;
                     }
+                    out[s.pos] = 0;
+                    finish(s);
+                }
+                else if (s.stage == LookupState::Compare)
+                {
+                    leaf = reinterpret_cast<LeafNode*> (s.node);
+                    idx = leaf->findKVIndex(keys[s.pos], s.candidates);
+                    out[s.pos] = idx != MAX_LEAF_SIZE ? leaf->kv_pairs[idx].value : 0;
+                    finish(s);
                 }
-                removeLeafAndMergeInnerNodes(i, indexNode_level);
             }
-            decision = Result::Delete;
         }
-        lock_delete.release();
-        /*---------------- Critical Section -----------------*/
+        lock_find.release();
     }
-    if (decision == Result::Remove)
+#endif
+}
+
+
+#ifdef PMEM
+    // persist fingerprints from slot on together with the bitmap that follows them, one line with LEAF_HEADER_LINE
+    static inline void persistLeafHeader(LeafNode* leaf, uint64_t slot)
     {
-        leaf->bitmap.reset(lstat.kv_idx);
-        #ifdef PMEM
-            TOID(struct LeafNode) lf = pmemobj_oid(leaf);
-            pmemobj_persist(pop, &D_RO(lf)->bitmap, sizeof(D_RO(lf)->bitmap));
-        #endif
-        leaf->Unlock();
+        const uint8_t* start = slot < MAX_LEAF_SIZE ? &leaf->fingerprints[slot] : 
+                               reinterpret_cast<const uint8_t*> (&leaf->bitmap);
+        pmemPersist(start, reinterpret_cast<const uint8_t*> (&leaf->bitmap + 1) - start);
     }
-    else if (decision == Result::Delete)
-    {
-        #ifdef PMEM
-            TOID(struct LeafNode) lf = pmemobj_oid(leaf);
-            
-            // Get uLog from deleteLogQueue
-            Log* log;
-            if (!deleteLogQueue.pop(log)) { assert("Delete log queue pop error!"); }
-
-            //set uLog.PCurrentLeaf to persistent address of Leaf
-            log->PCurrentLeaf = lf;
-            pmemobj_persist(pop, &(log->PCurrentLeaf), SIZE_PMEM_POINTER);
+#endif
+
+bool FPtree::splitLeafAndUpdateInnerParents(LeafNode* reachedLeafNode, Result decision, struct KV kv, 
+                                            bool updateFunc = false, uint64_t prevPos = MAX_LEAF_SIZE)
+{
+    uint64_t splitKey;
+    LeafNode* newLeafNode;
+
+    #ifdef PMEM
+        TOID(struct LeafNode) insertNode = pmemobj_oid(reachedLeafNode);
+    #else
+        LeafNode* insertNode = reachedLeafNode;
+    #endif
+
+    if (decision == Result::Split)
+    {
+        if ((newLeafNode = splitLeaf(reachedLeafNode, splitKey)) == nullptr)   // split and link two leaves
+            return false;
+        if (kv.key >= splitKey)                      // select one leaf to insert
+            insertNode = reachedLeafNode->p_next;
+    }
+
+    #ifdef PMEM
+        uint64_t slot = D_RW(insertNode)->bitmap.first_zero();
+        assert(slot < MAX_LEAF_SIZE && "Slot idx out of bound");
+        D_RW(insertNode)->kv_pairs[slot] = kv; 
+        pmemPersist(&D_RO(insertNode)->kv_pairs[slot], sizeof(struct KV));
+
+        // fingerprint and bitmap go out in one flush, recovery rebuilds a torn fingerprint
+        D_RW(insertNode)->fingerprints[slot] = getOneByteHash(kv.key);
+        if (!updateFunc)
+        {
+            D_RW(insertNode)->addSortedSlot(slot);
+            D_RW(insertNode)->bitmap.set(slot);
+        }
+        else 
+        {
+            D_RW(insertNode)->replaceSortedSlot(prevPos, slot);
+            Bitset tmpBitmap = D_RW(insertNode)->bitmap;
+            tmpBitmap.reset(prevPos); tmpBitmap.set(slot);
+            D_RW(insertNode)->bitmap = tmpBitmap;
+        }
+        persistLeafHeader(D_RW(insertNode), slot);
+    #else
+        if (updateFunc)
+            insertNode->kv_pairs[prevPos].value = kv.value;
+        else
+            insertNode->addKV(kv);
+    #endif
+
+    if (decision == Result::Split)
+    {   
+        #ifdef PMEM
+            if (deferSplit(splitKey, newLeafNode))
+            {
+                newLeafNode->Unlock();
+                return true;
+            }
+        #endif
+        tbb::speculative_spin_rw_mutex::scoped_lock lock_split;
+        /*---------------- Second Critical Section -----------------*/
+        acquireSMO(lock_split);
+        updateInnerParents(reachedLeafNode, newLeafNode, splitKey);
+        newLeafNode->Unlock();
+        releaseSMO(lock_split);
+        /*---------------- End of Second Critical Section -----------------*/
+    }
+    return true;
+}
+
+
+void FPtree::updateInnerParents(LeafNode* leaf, LeafNode* newLeafNode, uint64_t splitKey)
+{
+    uint64_t mid = MAX_INNER_SIZE / 2, new_splitKey, insert_pos;
+    InnerNode* cur, *parent, *newInnerNode;
+    BaseNode* child;
+    short i = 0, idx;
+    if (!root->isInnerNode) // splitting when tree has only root 
+    {
+        cur = new InnerNode();
+        cur->init(splitKey, leaf, newLeafNode);
+        __atomic_store_n(&root, cur, __ATOMIC_RELEASE);
+    }
+    else // need to retraverse & update parent
+    {
+        cur = reinterpret_cast<InnerNode*> (root);
+        while(cur->isInnerNode)
+        {
+            inners[i] = cur;
+            idx = cur->findChildIndex(splitKey);
+            ppos[i++] = idx;
+            cur = reinterpret_cast<InnerNode*> (cur->p_children[idx]);
+        }
+        parent = inners[--i];
+        child = newLeafNode;
+        while (true)
+        {
+            insert_pos = ppos[i--];
+            lockInner(parent);
+            if (parent->nKey < MAX_INNER_SIZE)
+            {
+                parent->addKey(insert_pos, splitKey, child);
+                break;
+            }
+            else 
+            {
+                newInnerNode = new InnerNode();
+                parent->nKey = mid;
+                if (insert_pos != mid)
+                {
+                    new_splitKey = parent->keys[mid];
+                    std::copy(parent->keys + mid + 1, parent->keys + MAX_INNER_SIZE, newInnerNode->keys);
+                    std::copy(parent->p_children + mid + 1, parent->p_children + MAX_INNER_SIZE + 1, newInnerNode->p_children);
+                    newInnerNode->nKey = MAX_INNER_SIZE - mid - 1;
+                    if (insert_pos < mid)
+                        parent->addKey(insert_pos, splitKey, child);
+                    else
+                        newInnerNode->addKey(insert_pos - mid - 1, splitKey, child);
+                }
+                else 
+                {
+                    new_splitKey = splitKey;
+                    std::copy(parent->keys + mid, parent->keys + MAX_INNER_SIZE, newInnerNode->keys);
+                    std::copy(parent->p_children + mid, parent->p_children + MAX_INNER_SIZE + 1, newInnerNode->p_children);
+                    newInnerNode->p_children[0] = child;
+                    newInnerNode->nKey = MAX_INNER_SIZE - mid;
+                }
+                splitKey = new_splitKey;
+                if (parent == root)
+                {
+                    cur = new InnerNode(splitKey, parent, newInnerNode);
+                    __atomic_store_n(&root, cur, __ATOMIC_RELEASE);
+                    break;
+                }
+                parent = inners[i];
+                child = newInnerNode;
+            }
+        }
+    }
+}
+
+
+void FPtree::updateInnerParents(LeafNode* leaf, const std::vector<std::pair<uint64_t, LeafNode*>>& splits)
+{
+    // keys and children to add into parent at pos, each child right of its key. The separators all fall
+    // between the separators around leaf, so they go in next to each other
+    std::vector<uint64_t> keys, all_keys;
+    std::vector<BaseNode*> children, all_children;
+    for (auto& split : splits)
+    {
+        keys.push_back(split.first);
+        children.push_back(split.second);
+    }
+    InnerNode* parent = nullptr, *node;
+    BaseNode* left = leaf;      // only child of a new root when parent is nullptr
+    uint64_t pos = 0, nKey, total, nodes, end;
+    short level = 0, idx;
+    if (root->isInnerNode)
+    {
+        InnerNode* cur = reinterpret_cast<InnerNode*> (root);
+        while (cur->isInnerNode)
+        {
+            inners[level] = cur;
+            idx = cur->findChildIndex(keys.front());
+            ppos[level++] = idx;
+            cur = reinterpret_cast<InnerNode*> (cur->p_children[idx]);
+        }
+        parent = inners[--level];
+        pos = ppos[level];
+    }
+    while (true)
+    {
+        nKey = parent ? parent->nKey : 0;
+        if (parent && nKey + keys.size() <= MAX_INNER_SIZE)
+        {
+            lockInner(parent);
+            parent->addKeys(pos, keys.data(), children.data(), keys.size());
+            return;
+        }
+        // parent is full, or there is none above the root: merge the new keys in and spread them over
+        // as few nodes as needed, the first one being parent, then carry their separators one level up
+        if (parent)
+        {
+            all_keys.assign(parent->keys, parent->keys + pos);
+            all_children.assign(parent->p_children, parent->p_children + pos + 1);
+        }
+        else
+        {
+            all_keys.clear();
+            all_children.assign(1, left);
+        }
+        all_keys.insert(all_keys.end(), keys.begin(), keys.end());
+        all_children.insert(all_children.end(), children.begin(), children.end());
+        if (parent)
+        {
+            all_keys.insert(all_keys.end(), parent->keys + pos, parent->keys + nKey);
+            all_children.insert(all_children.end(), parent->p_children + pos + 1, parent->p_children + nKey + 1);
+        }
+        total = all_children.size();
+        nodes = (total + MAX_INNER_SIZE) / (MAX_INNER_SIZE + 1);
+        keys.clear();
+        children.clear();
+        for (uint64_t n = 0, begin = 0; n < nodes; n++, begin = end)
+        {
+            end = total * (n + 1) / nodes;      // children [begin, end) and the keys between them
+            if (n == 0 && parent)
+            {
+                node = parent;
+                lockInner(node);
+            }
+            else
+                node = new InnerNode();
+            std::copy(all_keys.begin() + begin, all_keys.begin() + end - 1, node->keys);
+            std::copy(all_children.begin() + begin, all_children.begin() + end, node->p_children);
+            node->nKey = end - begin - 1;
+            if (n == 0)
+                left = node;
+            else
+            {
+                keys.push_back(all_keys[begin - 1]);
+                children.push_back(node);
+            }
+        }
+        if (nodes == 1)     // a new root over the old one
+        {
+            __atomic_store_n(&root, left, __ATOMIC_RELEASE);
+            return;
+        }
+        if (parent == nullptr || level == 0)
+            parent = nullptr;
+        else
+        {
+            parent = inners[--level];
+            pos = ppos[level];
+        }
+    }
+}
+
+// overwrite the value in slot of a locked leaf, the 8-byte store is failure atomic on its own
+static inline void writeValue(LeafNode* leaf, uint64_t slot, uint64_t value)
+{
+    leaf->kv_pairs[slot].value = value;
+    #ifdef PMEM
+        pmemPersist(&leaf->kv_pairs[slot].value, sizeof(uint64_t));
+    #endif
+}
+
+bool FPtree::update(struct KV kv)
+{
+    EpochGuard epoch_guard;
+    LeafNode* reachedLeafNode;
+    uint64_t prevPos, upper;
+    bool bounded;
+    if ((reachedLeafNode = lockLeaf(kv.key, upper, bounded)) == nullptr)
+        return false;
+    prevPos = reachedLeafNode->findKVIndex(kv.key);
+    if (prevPos == MAX_LEAF_SIZE) // key not found
+    {
+        reachedLeafNode->Unlock();
+        return false;
+    }
+    #ifdef OUT_OF_PLACE_UPDATE
+        Result decision = reachedLeafNode->isFull() ? Result::Split : Result::Update;
+        if (!splitLeafAndUpdateInnerParents(reachedLeafNode, decision, kv, true, prevPos))
+        {
+            reachedLeafNode->Unlock();
+            return false;
+        }
+    #else
+        writeValue(reachedLeafNode, prevPos, kv.value);
+    #endif
+
+    reachedLeafNode->Unlock();
+    
+    return true;
+}
+
+
+LeafNode* FPtree::lockLeafOrInsertRoot(struct KV kv, bool& inserted)
+{
+    tbb::speculative_spin_rw_mutex::scoped_lock lock_insert;
+    LeafNode* reachedLeafNode;
+    uint64_t upper;
+    bool bounded;
+    while ((reachedLeafNode = lockLeaf(kv.key, upper, bounded)) == nullptr)  // if tree is empty
+    {
+        acquireSMO(lock_insert);
+        if (!root)
+        {
+            #ifdef PMEM
+                struct argLeafNode args(kv);
+                TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+                LeafNode* leaf = allocLeaf();
+                if ((inserted = leaf != nullptr))
+                {
+                    constructLeafNode(pop, leaf, &args);
+                    D_RW(ListHead)->head = pmemobj_oid(leaf);
+                    pmemPersist(&D_RO(ListHead)->head, sizeof(D_RO(ListHead)->head));
+                    __atomic_store_n(&root, leaf, __ATOMIC_RELEASE);
+                }
+            #else
+                LeafNode* leaf = new LeafNode();
+                leaf->addKV(kv);
+                __atomic_store_n(&root, leaf, __ATOMIC_RELEASE);
+                inserted = true;
+            #endif
+            releaseSMO(lock_insert);
+            return nullptr;
+        }
+        releaseSMO(lock_insert);
+    }
+    return reachedLeafNode;
+}
+
+
+bool FPtree::insert(struct KV kv) 
+{
+    EpochGuard epoch_guard;
+    Result decision = Result::Abort;
+    LeafNode* reachedLeafNode;
+    int idx;
+    bool inserted;
+    if ((reachedLeafNode = lockLeafOrInsertRoot(kv, inserted)) == nullptr)
+        return inserted;
+    idx = reachedLeafNode->findKVIndex(kv.key);
+    if (idx != MAX_LEAF_SIZE)
+        reachedLeafNode->Unlock();
+    else
+        decision = reachedLeafNode->isFull() ? Result::Split : Result::Insert;
+
+    if (decision == Result::Abort)  // kv already exists
+        return false;
+
+    inserted = splitLeafAndUpdateInnerParents(reachedLeafNode, decision, kv);
+
+    reachedLeafNode->Unlock();
+    
+    return inserted;
+}
+
+
+
+bool FPtree::upsert(struct KV kv)
+{
+    EpochGuard epoch_guard;
+    LeafNode* leaf;
+    uint64_t slot;
+    bool inserted;
+    if ((leaf = lockLeafOrInsertRoot(kv, inserted)) == nullptr)
+        return inserted;
+    if ((slot = leaf->findKVIndex(kv.key)) != MAX_LEAF_SIZE)
+    {
+        writeValue(leaf, slot, kv.value);
+        leaf->Unlock();
+        return false;
+    }
+    inserted = splitLeafAndUpdateInnerParents(leaf, leaf->isFull() ? Result::Split : Result::Insert, kv);
+    leaf->Unlock();
+    return inserted;
+}
+
+bool FPtree::fetchAdd(uint64_t key, uint64_t delta, uint64_t& old_value, bool* found)
+{
+    EpochGuard epoch_guard;
+    LeafNode* leaf;
+    uint64_t slot;
+    bool inserted;
+    old_value = 0;
+    if (found)
+        *found = false;
+    if ((leaf = lockLeafOrInsertRoot(KV(key, delta), inserted)) == nullptr)
+        return inserted;
+    if ((slot = leaf->findKVIndex(key)) != MAX_LEAF_SIZE)
+    {
+        old_value = leaf->kv_pairs[slot].value;
+        writeValue(leaf, slot, old_value + delta);
+        leaf->Unlock();
+        if (found)
+            *found = true;
+        return true;
+    }
+    inserted = splitLeafAndUpdateInnerParents(leaf, leaf->isFull() ? Result::Split : Result::Insert, KV(key, delta));
+    leaf->Unlock();
+    return inserted;
+}
+
+bool FPtree::compareAndSwap(uint64_t key, uint64_t expected, uint64_t desired)
+{
+    EpochGuard epoch_guard;
+    LeafNode* leaf;
+    uint64_t slot, upper;
+    bool bounded, swapped = false;
+    if ((leaf = lockLeaf(key, upper, bounded)) == nullptr)
+        return false;
+    if ((slot = leaf->findKVIndex(key)) != MAX_LEAF_SIZE && leaf->kv_pairs[slot].value == expected)
+    {
+        writeValue(leaf, slot, desired);
+        swapped = true;
+    }
+    leaf->Unlock();
+    return swapped;
+}
+
+/*
+    Make slots written by a batch visible: kvs are flushed first with a single fence, then
+    the bitmap is switched and persisted once together with the fingerprints, so a crash
+    in between only loses the batch for this leaf.
+*/
+static void persistLeafBatch(LeafNode* leaf, uint64_t set_bits, uint64_t reset_bits)
+{
+    if (!(set_bits | reset_bits))
+        return;
+    #ifdef PMEM
+        uintptr_t line, last_line = 0;
+        for (uint64_t bits = set_bits; bits; bits &= bits - 1)
+        {
+            line = reinterpret_cast<uintptr_t> (&leaf->kv_pairs[__builtin_ctzll(bits)]) & ~(uintptr_t)63;
+            if (line != last_line)
+                pmemFlush(reinterpret_cast<void*> (line), 64);
+            last_line = line;
+        }
+        pmemFence();
+    #endif
+    Bitset tmpBitmap = leaf->bitmap;
+    tmpBitmap.bits = (tmpBitmap.bits & ~reset_bits) | set_bits;
+    leaf->bitmap = tmpBitmap;
+    #ifdef PMEM
+        persistLeafHeader(leaf, set_bits ? __builtin_ctzll(set_bits) : MAX_LEAF_SIZE);
+    #endif
+    leaf->sortSlots();
+}
+
+
+uint64_t FPtree::applyLeafBatch(LeafNode* leaf, const KV* kvs, size_t n, bool updateFunc)
+{
+    // leaves produced by splits in this batch, in list order with their lower bound
+    std::vector<std::pair<uint64_t, LeafNode*>> chain(1, std::make_pair(0, leaf));
+    std::vector<std::pair<uint64_t, LeafNode*>> splits;
+    LeafNode* cur = leaf, *newLeafNode;
+    uint64_t set_bits = 0, reset_bits = 0, free_bits, prevPos, slot, splitKey, applied = 0;
+    size_t cur_idx = 0;
+    for (size_t k = 0; k < n; k++)
+    {
+        while (cur_idx + 1 < chain.size() && kvs[k].key >= chain[cur_idx + 1].first)
+        {
+            persistLeafBatch(cur, set_bits, reset_bits);
+            set_bits = reset_bits = 0;
+            cur = chain[++cur_idx].second;
+        }
+        prevPos = cur->findKVIndex(kvs[k].key);
+        if ((prevPos == MAX_LEAF_SIZE) == updateFunc)  // key missing for update, or present for insert
+            continue;
+        #if !defined(OUT_OF_PLACE_UPDATE) || !defined(PMEM)
+            if (updateFunc)     // in place, each value is flushed here and drained once at the end
+            {
+                cur->kv_pairs[prevPos].value = kvs[k].value;
+                #ifdef PMEM
+                    pmemFlush(&cur->kv_pairs[prevPos].value, sizeof(uint64_t));
+                #endif
+                applied++;
+                continue;
+            }
+        #endif
+        free_bits = ~(cur->bitmap.bits | set_bits) & offset;
+        if (!free_bits)
+        {
+            persistLeafBatch(cur, set_bits, reset_bits);
+            set_bits = reset_bits = 0;
+            free_bits = ~cur->bitmap.bits & offset;
+        }
+        if (!free_bits)     // leaf is full, split it and keep going in the half that takes the key
+        {
+            if ((newLeafNode = splitLeaf(cur, splitKey)) == nullptr)   // out of leaves, stop here
+                break;
+            chain.insert(chain.begin() + cur_idx + 1, std::make_pair(splitKey, newLeafNode));
+            splits.push_back(std::make_pair(splitKey, newLeafNode));
+            if (kvs[k].key >= splitKey)
+                cur = chain[++cur_idx].second;
+            if (updateFunc)
+                prevPos = cur->findKVIndex(kvs[k].key);
+            free_bits = ~cur->bitmap.bits & offset;
+        }
+        slot = __builtin_ctzll(free_bits);
+        cur->kv_pairs[slot] = kvs[k];
+        cur->fingerprints[slot] = getOneByteHash(kvs[k].key);
+        set_bits |= (uint64_t)1 << slot;
+        if (updateFunc)
+            reset_bits |= (uint64_t)1 << prevPos;
+        applied++;
+    }
+    persistLeafBatch(cur, set_bits, reset_bits);
+    #if defined(PMEM) && !defined(OUT_OF_PLACE_UPDATE)
+        if (updateFunc)
+            pmemFence();
+    #endif
+
+    #ifdef PMEM
+        deferSplits(splits);
+    #endif
+    if (!splits.empty())
+    {
+        // a leaf may split again below an earlier split of it, the separators go in in key order
+        std::sort(splits.begin(), splits.end(), [] (const std::pair<uint64_t, LeafNode*>& s1, 
+                                                    const std::pair<uint64_t, LeafNode*>& s2) {
+            return s1.first < s2.first;
+        });
+        tbb::speculative_spin_rw_mutex::scoped_lock lock_split;
+        /*---------------- Critical Section -----------------*/
+        acquireSMO(lock_split);
+        updateInnerParents(leaf, splits);
+        for (auto& split : splits)
+            split.second->Unlock();
+        releaseSMO(lock_split);
+        /*---------------- End of Critical Section -----------------*/
+    }
+    return applied;
+}
+
+
+uint64_t FPtree::modifyBatch(const KV* kvs, size_t n, bool updateFunc)
+{
+    EpochGuard epoch_guard;
+    if (n == 0)
+        return 0;
+    std::vector<KV> batch(kvs, kvs + n);
+    std::stable_sort(batch.begin(), batch.end(), [] (const KV& kv1, const KV& kv2) {
+        return kv1.key < kv2.key;
+    });
+    // duplicated keys: the first insert wins, the last update wins
+    size_t m = 0;
+    for (size_t k = 0; k < n; k++)
+    {
+        if (m && batch[m - 1].key == batch[k].key)
+        {
+            if (updateFunc)
+                batch[m - 1] = batch[k];
+        }
+        else
+            batch[m++] = batch[k];
+    }
+
+    LeafNode* leaf;
+    uint64_t upper = 0, applied = 0;
+    bool bounded;
+    size_t i = 0, j;
+    while (i < m)
+    {
+        if ((leaf = lockLeaf(batch[i].key, upper, bounded)) == nullptr)
+        {
+            if (updateFunc)
+                break;
+            applied += insert(batch[i++]);  // empty tree, let insert create the root
+            continue;
+        }
+
+        // leaf is locked, so its key range can only grow until we unlock it
+        for (j = i; j < m && (!bounded || batch[j].key < upper); j++);
+        applied += applyLeafBatch(leaf, &batch[i], j - i, updateFunc);
+        leaf->Unlock();
+        i = j;
+    }
+    return applied;
+}
+
+
+uint64_t FPtree::insertBatch(const KV* kvs, size_t n)
+{
+    return modifyBatch(kvs, n, false);
+}
+
+
+uint64_t FPtree::updateBatch(const KV* kvs, size_t n)
+{
+    return modifyBatch(kvs, n, true);
+}
+
+
+LeafNode* FPtree::splitLeaf(LeafNode* leaf, uint64_t& splitKey)
+{
+    // leaf is full, the upper half of its sorted slots moves to the new leaf
+    uint64_t mid = MAX_LEAF_SIZE / 2;
+    splitKey = leaf->kv_pairs[leaf->sortedSlots()[mid]].key;
+    #ifdef PMEM
+        // Get uLog from the split log of this thread
+        Log* log = &threadLogSlot()->split;
+
+        //set uLog.PCurrentLeaf to persistent address of Leaf
+        log->PCurrentLeaf = pmemobj_oid(leaf);
+        pmemPersist(&(log->PCurrentLeaf), SIZE_PMEM_POINTER);
+
+        // NewLeaf is unreachable until Leaf.Next is set, a crash before that leaves it free
+        LeafNode* newLeafNode = allocLeaf();
+        if (newLeafNode == nullptr)     // out of leaves, undo the log and leave Leaf as it is
+        {
+            log->PCurrentLeaf = OID_NULL;
+            pmemPersist(&(log->PCurrentLeaf), SIZE_PMEM_POINTER);
+            return nullptr;
+        }
+        log->PLeaf = pmemobj_oid(newLeafNode);
+        pmemPersist(&(log->PLeaf), SIZE_PMEM_POINTER);
+
+        // Copy the content of Leaf into NewLeaf
+        struct argLeafNode args(leaf);
+        for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
+        {
+            if (args.kv_pairs[i].key < splitKey)
+                args.bitmap.reset(i);
+        }
+        std::memmove(args.sorted_slots, leaf->sortedSlots() + mid, MAX_LEAF_SIZE - mid);
+        constructLeafNode(pop, newLeafNode, &args);
+        markLeafPrepared(newLeafNode, splitKey);
+
+        // Persist(NewLeaf.Next)
+        newLeafNode->p_next = leaf->p_next;
+        pmemPersist(&newLeafNode->p_next, sizeof(newLeafNode->p_next));
+
+        // Persist(Leaf.Next)
+        leaf->p_next = pmemobj_oid(newLeafNode);
+        pmemPersist(&leaf->p_next, sizeof(leaf->p_next));
+
+        // Leaf.Bitmap = inverse(NewLeaf.Bitmap)
+        leaf->bitmap = newLeafNode->bitmap;
+        if constexpr (MAX_LEAF_SIZE != 1)  leaf->bitmap.flip();
+
+        // Persist(Leaf.Bitmap)
+        pmemPersist(&leaf->bitmap, sizeof(leaf->bitmap));
+
+        // reset uLog
+        log->PCurrentLeaf = OID_NULL;
+        log->PLeaf = OID_NULL;
+        pmemPersist(&(log->PCurrentLeaf), SIZE_PMEM_POINTER);
+        pmemPersist(&(log->PLeaf), SIZE_PMEM_POINTER);
+    #else
+        LeafNode* newLeafNode = new LeafNode(*leaf);
+
+        for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
+        {
+            if (newLeafNode->kv_pairs[i].key < splitKey)
+                newLeafNode->bitmap.reset(i);
+        }
+        std::memmove(newLeafNode->sorted_slots, leaf->sorted_slots + mid, MAX_LEAF_SIZE - mid);
+
+        leaf->bitmap = newLeafNode->bitmap;
+        leaf->bitmap.flip();
+        leaf->p_next = newLeafNode;
+    #endif
+ 
+    return newLeafNode;
+}
+
+
+#ifdef PMEM
+    void FPtree::recoverSplit(Log* uLog)
+    {
+        if (TOID_IS_NULL(uLog->PCurrentLeaf))
+        {
+            return;
+        }
+        
+        if (!TOID_IS_NULL(uLog->PLeaf))
+        {
+            LeafNode* leaf = D_RW(uLog->PCurrentLeaf);
+            if (pmemobj_direct(leaf->p_next.oid) == pmemobj_direct(uLog->PLeaf.oid))  // Crashed after linking NewLeaf
+            {
+                // Leaf keeps only the keys below NewLeaf, the others moved to NewLeaf (and the leaves
+                // after it for a split by mergeSorted). For a full leaf this is inverse(NewLeaf.Bitmap)
+                uint64_t splitKey = D_RW(uLog->PLeaf)->minKey();
+                for (size_t i = 0; i < MAX_LEAF_SIZE; i++)
+                {
+                    if (leaf->bitmap.test(i) && leaf->kv_pairs[i].key >= splitKey)
+                        leaf->bitmap.reset(i);
+                }
+
+                // Persist(Leaf.Bitmap)
+                pmemPersist(&leaf->bitmap, sizeof(leaf->bitmap));
+            }
+            // otherwise NewLeaf was never linked, Leaf is unchanged and NewLeaf is free again
+        }
+
+        // reset uLog
+        uLog->PCurrentLeaf = OID_NULL;
+        uLog->PLeaf = OID_NULL;
+    }
+#endif
+
+void FPtree::removeLeafAndMergeInnerNodes(short i, short indexNode_level)
+{
+    InnerNode* parent = inners[i];
+    uint64_t new_key = 0, child_idx = ppos[i];
+
+    lockInner(parent);
+    if (child_idx == 0)
+    {
+        new_key = parent->keys[0];
+        parent->removeKey(child_idx, false);
+        if (indexNode_level >= 0 && inners[indexNode_level] != parent)
+        {
+            for (short j = indexNode_level; j < i; j++)   // see deleteKey
+                lockInner(inners[j]);
+            inners[indexNode_level]->keys[ppos[indexNode_level] - 1] = new_key;
+        }
+    }
+    else
+        parent->removeKey(child_idx - 1, true);
+    mergeInnerNodes(i);
+}
+
+void FPtree::mergeInnerNodes(short i)
+{
+    InnerNode* temp, *left, *right, *parent = inners[i];
+    uint64_t left_idx, child_idx;
+
+    while (!parent->nKey) // parent has no key, merge with sibling
+    {
+        if (parent == root) // entire tree stores 1 kv, convert the only leafnode into root
+        {
+            temp = reinterpret_cast<InnerNode*> (root);
+            __atomic_store_n(&root, parent->p_children[0], __ATOMIC_RELEASE);
+            freeInner(temp);
+            break;         
+        }
+        parent = inners[--i];
+        lockInner(parent);
+        child_idx = ppos[i];
+        left_idx = child_idx;
+        if (!(child_idx != 0 && tryBorrowKey(parent, child_idx, child_idx-1)) && 
+            !(child_idx != parent->nKey && tryBorrowKey(parent, child_idx, child_idx+1))) // if cannot borrow from any siblings
+        {
+            if (left_idx != 0)
+                left_idx --;
+            left = reinterpret_cast<InnerNode*> (parent->p_children[left_idx]);
+            right = reinterpret_cast<InnerNode*> (parent->p_children[left_idx + 1]);
+
+            if (left->nKey == 0)
+            {
+                lockInner(right);
+                right->addKey(0, parent->keys[left_idx], left->p_children[0], false);
+                freeInner(left);
+                parent->removeKey(left_idx, false);
+            }
+            else
+            {
+                lockInner(left);
+                left->addKey(left->nKey, parent->keys[left_idx], right->p_children[0]);
+                freeInner(right);
+                parent->removeKey(left_idx);
+            }
+        }
+        else
+            break;
+    }
+}
+
+void FPtree::freeInnerTree(InnerNode* node)
+{
+    for (uint64_t c = 0; c <= node->nKey; c++)
+        if (node->p_children[c]->isInnerNode)
+            freeInnerTree(reinterpret_cast<InnerNode*> (node->p_children[c]));
+    freeInner(node);
+}
+
+void FPtree::resetLowSeparator(uint64_t key, uint64_t new_key)
+{
+    BaseNode* cur = root;
+    short i = 0, sib_level = -1;
+
+    while (cur && cur->isInnerNode)
+    {
+        inners[i] = reinterpret_cast<InnerNode*> (cur);
+        if ((ppos[i] = inners[i]->findChildIndex(key)) != 0)
+            sib_level = i;
+        cur = inners[i]->p_children[ppos[i]];
+        i++;
+    }
+    if (sib_level < 0 || inners[sib_level]->keys[ppos[sib_level] - 1] == new_key)
+        return;
+    for (short j = sib_level; j < i; j++)     // see deleteKey
+        lockInner(inners[j]);
+    inners[sib_level]->keys[ppos[sib_level] - 1] = new_key;
+}
+
+void FPtree::removeLeafRun(LeafNode* first, LeafNode* last, uint64_t key_before, uint64_t key_after)
+{
+    InnerNode* first_path[32], *last_path[32], *left, *right;
+    short first_pos[32], last_pos[32], depth, h, i, top;
+    BaseNode* cur;
+    uint64_t key;
+    int64_t start, end;
+    bool drop_first = true, drop_last = true;   // the child of each path one level down is removed entirely
+
+    if (!root->isInnerNode)     // first is the only leaf
+    {
+        __atomic_store_n(&root, nullptr, __ATOMIC_RELEASE);
+        return;
+    }
+    key = first->minKey();
+    for (cur = root, depth = 0; cur->isInnerNode; depth++)
+    {
+        first_path[depth] = reinterpret_cast<InnerNode*> (cur);
+        first_pos[depth] = first_path[depth]->findChildIndex(key);
+        cur = first_path[depth]->p_children[first_pos[depth]];
+    }
+    key = last->minKey();
+    for (cur = root, h = 0; cur->isInnerNode; h++)
+    {
+        last_path[h] = reinterpret_cast<InnerNode*> (cur);
+        last_pos[h] = last_path[h]->findChildIndex(key);
+        cur = last_path[h]->p_children[last_pos[h]];
+    }
+
+    // children of a removed slot that are not on either path lie entirely inside the run
+    auto freeSlots = [&] (InnerNode* node, int64_t from, int64_t to)
+    {
+        BaseNode* child;
+        for (int64_t c = from; h + 1 < depth && c <= to; c++)
+        {
+            child = node->p_children[c];
+            if (child == first_path[h + 1] || child == last_path[h + 1])
+                freeInner(reinterpret_cast<InnerNode*> (child));
+            else
+                freeInnerTree(reinterpret_cast<InnerNode*> (child));
+        }
+    };
+
+    // bottom-up, remove the slots between the children kept on both paths; a node that loses all
+    // its children is in turn removed from the level above
+    for (h = depth - 1; h >= 0; h--)
+    {
+        left = first_path[h];
+        right = last_path[h];
+        start = first_pos[h] + (drop_first ? 0 : 1);
+        end = last_pos[h] - (drop_last ? 0 : 1);
+        if (left == right)
+        {
+            drop_first = drop_last = start <= end && end - start == (int64_t)left->nKey;
+            if (start <= end)
+            {
+                freeSlots(left, start, end);
+                if (!drop_first)
+                {
+                    lockInner(left);
+                    left->removeChildren(start, end);
+                }
+            }
+            continue;
+        }
+        drop_first = start == 0;
+        if (start <= (int64_t)left->nKey)
+        {
+            freeSlots(left, start, left->nKey);
+            if (!drop_first)
+            {
+                lockInner(left);
+                left->removeChildren(start, left->nKey);
+            }
+        }
+        drop_last = end == (int64_t)right->nKey;
+        if (end >= 0)
+        {
+            freeSlots(right, 0, end);
+            if (!drop_last)
+            {
+                lockInner(right);
+                right->removeChildren(0, end);
+            }
+        }
+    }
+    if (drop_first)     // every leaf is removed
+    {
+        freeInner(reinterpret_cast<InnerNode*> (root));
+        __atomic_store_n(&root, nullptr, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // nodes kept on either path may be left with a single child; the highest such node has a parent
+    // with keys (or is the root), so mergeInnerNodes can fix it and the ones above it give way in turn
+    for (int side = 0; side < 2; )
+    {
+        key = side == 0 ? key_before : key_after;
+        top = -1;
+        for (cur = root, i = 0; cur->isInnerNode && top < 0; i++)
+        {
+            inners[i] = reinterpret_cast<InnerNode*> (cur);
+            ppos[i] = inners[i]->findChildIndex(key);
+            if (inners[i]->nKey == 0)
+                top = i;
+            cur = inners[i]->p_children[ppos[i]];
+        }
+        if (top < 0)
+            side++;
+        else
+        {
+            mergeInnerNodes(top);
+            side = 0;
+        }
+    }
+}
+
+bool FPtree::deleteKey(uint64_t key)
+{
+    EpochGuard epoch_guard;
+    LeafNode* leaf, *sibling;
+    InnerNode *parent, *cur; 
+    tbb::speculative_spin_rw_mutex::scoped_lock lock_delete;
+    Result decision = Result::Abort;
+    LeafNodeStat lstat;
+    uint64_t upper;
+    bool bounded;
+    short i, idx, indexNode_level, sib_level;
+
+    // common case: other keys remain in leaf and key is not its min key, the only key that can
+    // also be a separator in an inner node, so locking the leaf is enough
+    if ((leaf = lockLeaf(key, upper, bounded)) == nullptr)
+        return false;
+    leaf->getStat(key, lstat);
+    if (lstat.kv_idx == MAX_LEAF_SIZE) // key not found
+    {
+        leaf->Unlock();
+        return false;
+    }
+    if (lstat.count > 1 && key > lstat.min_key)
+        decision = Result::Remove;
+    else
+        leaf->Unlock();
+
+    while (decision == Result::Abort) 
+    {
+        i = 0; indexNode_level = -1, sib_level = -1;
+        sibling = nullptr; 
+        /*---------------- Critical Section -----------------*/
+        acquireSMO(lock_delete);
+
+        if (!root) { releaseSMO(lock_delete); return false;} // empty tree
+        cur = reinterpret_cast<InnerNode*> (root);
+        while (cur->isInnerNode)
+        {
+            inners[i] = cur;
+            idx = cur->findChildIndex(key);
+            if (idx != 0 && cur->keys[idx - 1] == key) // just found index node
+                indexNode_level = i;
+            if (idx != 0)
+                sib_level = i;
+            ppos[i++] = idx;
+            cur = reinterpret_cast<InnerNode*> (cur->p_children[idx]);
+        }
+        parent = inners[--i];
+        leaf = reinterpret_cast<LeafNode*> (cur);
+
+        if (!leaf->Lock()) { releaseSMO(lock_delete); continue; }
+        leaf->getStat(key, lstat);
+        if (lstat.kv_idx == MAX_LEAF_SIZE) // key not found
+        {
+            decision = Result::NotFound;
+            leaf->Unlock();
+        }
+        else if (lstat.count > 1)   // leaf contains key and other keys
+        {
+            if (indexNode_level >= 0) // key appears in an inner node, need to replace
+            {
+                // the separator shrinks the range of every node below it on the path, lock them all
+                // so that optimistic traversals that went through it before fail validation
+                for (short j = indexNode_level; j <= i; j++)
+                    lockInner(inners[j]);
+                inners[indexNode_level]->keys[ppos[indexNode_level] - 1] = lstat.min_key;
+            }
+            decision = Result::Remove;
+        }
+        else // leaf contains key only
+        {
+            if (parent) // try lock left sibling if exist, then remove leaf from parent and update inner nodes
+            {
+                if (sib_level >= 0)   // left sibling exists
+                {
+                    cur = reinterpret_cast<InnerNode*> (inners[sib_level]->p_children[ppos[sib_level] - 1]);
+                    while (cur->isInnerNode)
+                        cur = reinterpret_cast<InnerNode*> (cur->p_children[cur->nKey]);
+                    sibling = reinterpret_cast<LeafNode*> (cur);
+                    if (!sibling->Lock())
+                    {
+                        releaseSMO(lock_delete); leaf->Unlock(); continue;
+                    }
+                }
+                removeLeafAndMergeInnerNodes(i, indexNode_level);
+            }
+            decision = Result::Delete;
+        }
+        releaseSMO(lock_delete);
+        /*---------------- Critical Section -----------------*/
+    }
+    if (decision == Result::Remove)
+    {
+        leaf->removeSortedSlot(lstat.kv_idx);
+        leaf->bitmap.reset(lstat.kv_idx);
+        #ifdef PMEM
+            TOID(struct LeafNode) lf = pmemobj_oid(leaf);
+            pmemPersist(&D_RO(lf)->bitmap, sizeof(D_RO(lf)->bitmap));
+        #endif
+        leaf->Unlock();
+    }
+    else if (decision == Result::Delete)
+    {
+        #ifdef PMEM
+            TOID(struct LeafNode) lf = pmemobj_oid(leaf);
+            
+            // Get uLog from the delete log of this thread
+            Log* log = &threadLogSlot()->del;
+
+            // PLeaf (null for the list head) goes first, a log is live once PCurrentLeaf is set
+            if (sibling)
+            {
+                log->PLeaf = pmemobj_oid(sibling);
+                pmemPersist(&(log->PLeaf), SIZE_PMEM_POINTER);
+            }
+            log->PCurrentLeaf = lf;
+            pmemPersist(&(log->PCurrentLeaf), SIZE_PMEM_POINTER);
 
             if (sibling) // set and persist sibling's p_next, then unlock sibling node
             {
                 TOID(struct LeafNode) sib = pmemobj_oid(sibling);
-                
-                log->PLeaf = sib;
-                pmemobj_persist(pop, &(log->PLeaf), SIZE_PMEM_POINTER);
-
                 D_RW(sib)->p_next = D_RO(lf)->p_next;
-                pmemobj_persist(pop, &D_RO(sib)->p_next, sizeof(D_RO(sib)->p_next));
+                pmemPersist(&D_RO(sib)->p_next, sizeof(D_RO(sib)->p_next));
                 sibling->Unlock();
             }
             else if (parent) // the node to delete is left most node, set and persist list head instead
             {
                 TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
                 D_RW(ListHead)->head = D_RO(lf)->p_next; 
-                pmemobj_persist(pop, &D_RO(ListHead)->head, sizeof(D_RO(ListHead)->head));
+                pmemPersist(&D_RO(ListHead)->head, sizeof(D_RO(ListHead)->head));
             }
             else
             {
                 TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
                 D_RW(ListHead)->head = OID_NULL; 
-                pmemobj_persist(pop, &D_RO(ListHead)->head, sizeof(D_RO(ListHead)->head));
+                pmemPersist(&D_RO(ListHead)->head, sizeof(D_RO(ListHead)->head));
                 root = nullptr;
             }
-            POBJ_FREE(&lf);
-
-            // reset uLog
+            // reset uLog, the unlinked leaf is free from here on
             log->PCurrentLeaf = OID_NULL;
             log->PLeaf = OID_NULL;
-            pmemobj_persist(pop, &(log->PCurrentLeaf), SIZE_PMEM_POINTER);
-            pmemobj_persist(pop, &(log->PLeaf), SIZE_PMEM_POINTER);
-            deleteLogQueue.push(log);
+            pmemPersist(&(log->PCurrentLeaf), SIZE_PMEM_POINTER);
+            pmemPersist(&(log->PLeaf), SIZE_PMEM_POINTER);
+            Epoch::retire(leaf, deleteLeaf);
         #else
             if (sibling)
             {
@@ -998,258 +2749,1396 @@ bool FPtree::deleteKey(uint64_t key)
             }
             else if (!parent)
                 root = nullptr;
-            delete leaf;
+            Epoch::retire(leaf, deleteLeaf);
         #endif
     }
     return decision != Result::NotFound;
 }
 
-#ifdef PMEM
-    void FPtree::recoverDelete(Log* uLog)
-    {
-        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
-        TOID(struct LeafNode) PHead = D_RW(ListHead)->head;
+uint64_t FPtree::deleteBatch(const uint64_t* keys, size_t n)
+{
+    EpochGuard epoch_guard;
+    std::vector<uint64_t> batch(keys, keys + n);
+    std::sort(batch.begin(), batch.end());
+    batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+
+    std::vector<std::pair<LeafNode*, uint64_t>> trimmed;    // locked leaves losing their min key, slots to clear
+    std::vector<uint64_t> last_keys;                        // keys left for deleteKey, each the last of its leaf
+    LeafNode* leaf;
+    uint64_t upper = 0, mask, idx, deleted = 0, min_bit;
+    bool bounded;
+    size_t b = 0, j;
+    while (b < batch.size())
+    {
+        if ((leaf = lockLeaf(batch[b], upper, bounded)) == nullptr)
+            break;
+        mask = 0;
+        for (j = b; j < batch.size() && (!bounded || batch[j] < upper); j++)
+            if ((idx = leaf->findKVIndex(batch[j])) != MAX_LEAF_SIZE)
+                mask |= (uint64_t)1 << idx;
+        b = j;
+        if (mask == 0)      // also the case for an empty leaf during a lazy rebuild
+        {
+            leaf->Unlock();
+            continue;
+        }
+
+        // the min key may be a separator in an inner node: a leaf keeping other keys stays locked until
+        // the separator is its new min key, removing the last key unlinks the leaf and is left to deleteKey
+        min_bit = (uint64_t)1 << leaf->sortedSlots()[0];
+        if ((mask & min_bit) && mask != leaf->bitmap.bits)
+        {
+            trimmed.push_back(std::make_pair(leaf, mask));
+            continue;
+        }
+        if (mask & min_bit)
+        {
+            last_keys.push_back(leaf->kv_pairs[__builtin_ctzll(min_bit)].key);
+            mask &= ~min_bit;
+        }
+        if (mask)
+        {
+            leaf->removeSortedSlots(mask);
+            leaf->bitmap.bits &= ~mask;
+            #ifdef PMEM
+                pmemPersist(&leaf->bitmap, sizeof(leaf->bitmap));
+            #endif
+            deleted += __builtin_popcountll(mask);
+        }
+        leaf->Unlock();
+    }
+
+    if (!trimmed.empty())
+    {
+        bool post = true;
+        #ifdef PMEM
+            // a lazy rebuild has no inner nodes to fix yet, leave the min keys to deleteKey
+            // instead of waiting for it with the leaves locked
+            if (rebuilding.load(std::memory_order_acquire))
+            {
+                post = false;
+                for (auto& t : trimmed)
+                {
+                    min_bit = (uint64_t)1 << t.first->sortedSlots()[0];
+                    last_keys.push_back(t.first->kv_pairs[__builtin_ctzll(min_bit)].key);
+                    t.second &= ~min_bit;
+                }
+            }
+        #endif
+        if (post)
+        {
+            tbb::speculative_spin_rw_mutex::scoped_lock lock_delete;
+            /*---------------- Critical Section -----------------*/
+            acquireSMO(lock_delete);
+            for (auto& t : trimmed)
+            {
+                const uint8_t* slots = t.first->sortedSlots();
+                for (idx = 0; (t.second >> slots[idx]) & 1; idx++);
+                resetLowSeparator(t.first->kv_pairs[slots[0]].key, t.first->kv_pairs[slots[idx]].key);
+            }
+            releaseSMO(lock_delete);
+            /*---------------- End of Critical Section -----------------*/
+        }
+        for (auto& t : trimmed)
+        {
+            if (t.second)
+            {
+                t.first->removeSortedSlots(t.second);
+                t.first->bitmap.bits &= ~t.second;
+                #ifdef PMEM
+                    pmemPersist(&t.first->bitmap, sizeof(t.first->bitmap));
+                #endif
+                deleted += __builtin_popcountll(t.second);
+            }
+            t.first->Unlock();
+        }
+    }
+    for (uint64_t key : last_keys)
+        deleted += deleteKey(key);
+    return deleted;
+}
+
+uint64_t FPtree::deleteRange(uint64_t lo, uint64_t hi)
+{
+    EpochGuard epoch_guard;
+    tbb::speculative_spin_rw_mutex::scoped_lock lock_delete;
+    std::vector<LeafNode*> kept, removed;                   // locked leaves, in list order
+    std::vector<std::pair<LeafNode*, uint64_t>> trimmed;    // kept leaf and slots to clear
+    LeafNode* leaf, *pred, *next;
+    InnerNode* cur, *sib_parent;
+    uint64_t mask, bits, deleted = 0, idx, sib_idx, upper, key;
+    bool bounded, busy, past_hi, pred_locked, min_lost;
+
+    if (lo > hi)
+        return 0;
+    while (true)
+    {
+        kept.clear(); removed.clear(); trimmed.clear();
+        pred = nullptr; busy = pred_locked = false;
+
+        // lock the leaves overlapping [lo, hi] in list order with leaf locks only, as deleteKey locks one,
+        // leaves in between are fully covered. Leaves after the first are only tried, a busy one makes us
+        // back off instead of waiting while holding the others
+        if ((leaf = lockLeaf(lo, upper, bounded)) == nullptr)
+            return 0;
+        while (true)
+        {
+            bits = leaf->bitmap.bits;
+            mask = 0; past_hi = false;
+            for (uint64_t slots = bits; slots; slots &= slots - 1)
+            {
+                idx = __builtin_ctzll(slots);
+                if (leaf->kv_pairs[idx].key > hi)
+                    past_hi = true;
+                else if (leaf->kv_pairs[idx].key >= lo)
+                    mask |= (uint64_t)1 << idx;
+            }
+            if (mask && mask == bits)
+            {
+                if (removed.empty() && !kept.empty())
+                    pred = kept.back();
+                removed.push_back(leaf);
+            }
+            else
+            {
+                kept.push_back(leaf);
+                if (mask)
+                    trimmed.push_back(std::make_pair(leaf, mask));
+            }
+            if (past_hi)
+                break;
+            #ifdef PMEM
+                next = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid);
+            #else
+                next = leaf->p_next;
+            #endif
+            if (next == nullptr)
+                break;
+            if (!next->Lock()) { busy = true; break; }
+            leaf = next;
+            #ifdef PMEM
+                if (rebuilding.load(std::memory_order_acquire))
+                    prepareLeaf(leaf);
+            #endif
+        }
+
+        // a kept leaf losing its min key may hold it as a separator, which must become its new min key
+        min_lost = false;
+        for (auto& t : trimmed)
+            min_lost |= (t.second >> t.first->sortedSlots()[0]) & 1;
+
+        // whole leaves go away or separators change: one SMO fixes the inner nodes for all of them
+        #ifdef PMEM
+            // a lazy rebuild has no inner nodes to fix yet, wait for it without holding any leaf
+            if (!busy && (!removed.empty() || min_lost) && rebuilding.load(std::memory_order_acquire))
+            {
+                for (LeafNode* l : kept)
+                    l->Unlock();
+                for (LeafNode* l : removed)
+                    l->Unlock();
+                awaitIndex();
+                continue;
+            }
+        #endif
+        if (!busy && (!removed.empty() || min_lost))
+        {
+            /*---------------- Critical Section -----------------*/
+            acquireSMO(lock_delete);
+            next = nullptr;
+            // the leaf before the removed ones changes its p_next, find it through the inner nodes
+            // if it was not reached from lo
+            if (!removed.empty() && !pred && root->isInnerNode)
+            {
+                cur = reinterpret_cast<InnerNode*> (root);
+                sib_parent = nullptr;
+                key = removed.front()->minKey();
+                while (cur->isInnerNode)
+                {
+                    if ((idx = cur->findChildIndex(key)) != 0)
+                    {
+                        sib_parent = cur;
+                        sib_idx = idx - 1;
+                    }
+                    cur = reinterpret_cast<InnerNode*> (cur->p_children[idx]);
+                }
+                if (sib_parent)
+                {
+                    pred = maxLeaf(sib_parent->p_children[sib_idx]);
+                    if (!(pred_locked = pred->Lock()))
+                        busy = true;
+                }
+            }
+            if (!busy && !removed.empty())
+            {
+                #ifdef PMEM
+                    next = (struct LeafNode *) pmemobj_direct((removed.back()->p_next).oid);
+                #else
+                    next = removed.back()->p_next;
+                #endif
+                // next is locked as the last kept leaf, if any
+                removeLeafRun(removed.front(), removed.back(), pred ? pred->minKey() : 0, 
+                              next ? next->minKey() : std::numeric_limits<uint64_t>::max());
+                // the separator in front of next bounded the first removed leaf
+                if (next && (trimmed.empty() || trimmed.back().first != next))
+                    resetLowSeparator(next->minKey(), next->minKey());
+            }
+            if (!busy)
+            {
+                for (auto& t : trimmed)
+                {
+                    for (idx = 0; (t.second >> t.first->sortedSlots()[idx]) & 1; idx++);
+                    resetLowSeparator(t.first->kv_pairs[t.first->sortedSlots()[0]].key, 
+                                      t.first->kv_pairs[t.first->sortedSlots()[idx]].key);
+                }
+            }
+            releaseSMO(lock_delete);
+            /*---------------- End of Critical Section -----------------*/
+        }
+        if (!busy)
+            break;
+        for (LeafNode* l : kept)
+            l->Unlock();
+        for (LeafNode* l : removed)
+            l->Unlock();
+        std::this_thread::yield();
+    }
+
+    #ifdef PMEM
+        // trims and unlink are one step: when there is more than one persist to make, log their results
+        // first, recoverDeleteRange rolls all of them forward after a crash
+        RangeLog* range_log = nullptr;
+        if (trimmed.size() + !removed.empty() > 1)
+        {
+            range_log = &threadLogSlot()->range;
+            range_log->PLeaf = pred ? pmemobj_oid(pred) : OID_NULL;
+            range_log->PFirst = removed.empty() ? OID_NULL : pmemobj_oid(removed.front());
+            range_log->PAfter = removed.empty() ? OID_NULL : removed.back()->p_next.oid;
+            for (idx = 0; idx < 2; idx++)     // only the first and last leaf of the range can be trimmed
+            {
+                range_log->PTrimmed[idx] = idx < trimmed.size() ? pmemobj_oid(trimmed[idx].first) : OID_NULL;
+                range_log->bitmaps[idx] = idx < trimmed.size() ? trimmed[idx].first->bitmap.bits & ~trimmed[idx].second : 0;
+            }
+            pmemPersist(range_log, sizeof(RangeLog));
+            range_log->valid = 1;
+            pmemPersist(&range_log->valid, sizeof(uint64_t));
+        }
+    #endif
+    for (auto& t : trimmed)
+    {
+        t.first->removeSortedSlots(t.second);
+        t.first->bitmap.bits &= ~t.second;
+        #ifdef PMEM
+            pmemPersist(&t.first->bitmap, sizeof(t.first->bitmap));
+        #endif
+        deleted += __builtin_popcountll(t.second);
+    }
+    for (LeafNode* r : removed)
+        deleted += r->bitmap.count();
+
+    if (!removed.empty())
+    {
+        // unlink all covered leaves at once by pointing pred (or the list head) past the last of them
+        #ifdef PMEM
+            TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+            TOID(struct LeafNode) after = removed.back()->p_next;
+
+            if (pred)
+            {
+                pred->p_next = after;
+                pmemPersist(&pred->p_next, sizeof(pred->p_next));
+            }
+            else
+            {
+                D_RW(ListHead)->head = after;
+                pmemPersist(&D_RO(ListHead)->head, sizeof(D_RO(ListHead)->head));
+            }
+        #else
+            if (pred)
+                pred->p_next = removed.back()->p_next;
+        #endif
+    }
+    #ifdef PMEM
+        // reset uLog, the unlinked leaves are free from here on
+        if (range_log)
+        {
+            range_log->valid = 0;
+            pmemPersist(&range_log->valid, sizeof(uint64_t));
+        }
+    #endif
+    for (LeafNode* r : removed)
+        Epoch::retire(r, deleteLeaf);
+    for (LeafNode* l : kept)
+        l->Unlock();
+    if (pred_locked)
+        pred->Unlock();
+    return deleted;
+}
+
+#ifdef PMEM
+    void FPtree::recoverDelete(Log* uLog)
+    {
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        TOID(struct LeafNode)* link;
+
+        if (!TOID_IS_NULL(uLog->PCurrentLeaf))
+        {
+            // PLeaf is the leaf kept before the removed ones, or null if they started at the list head
+            link = TOID_IS_NULL(uLog->PLeaf) ? &D_RW(ListHead)->head : &D_RW(uLog->PLeaf)->p_next;
+            if (pmemobj_direct(link->oid) == pmemobj_direct(uLog->PCurrentLeaf.oid))
+            {
+                // crashed before unlinking, complete the removal of the first leaf
+                *link = D_RO(uLog->PCurrentLeaf)->p_next;
+                pmemPersist(link, SIZE_PMEM_POINTER);
+            }
+        }
+        // unlinked leaves are reclaimed by rebuildLeafPool
+
+        // reset uLog
+        uLog->PCurrentLeaf = OID_NULL;
+        uLog->PLeaf = OID_NULL;
+        return;
+    }
+
+    void FPtree::recoverDeleteRange(RangeLog* uLog)
+    {
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        TOID(struct LeafNode)* link;
+
+        if (uLog->valid)
+        {
+            // the crash may come before, between or after the persists of deleteRange, all are redone
+            for (uint64_t i = 0; i < 2; i++)
+            {
+                if (TOID_IS_NULL(uLog->PTrimmed[i]))
+                    continue;
+                LeafNode* leaf = D_RW(uLog->PTrimmed[i]);
+                leaf->bitmap.bits = uLog->bitmaps[i];
+                pmemPersist(&leaf->bitmap, sizeof(leaf->bitmap));
+            }
+            if (!TOID_IS_NULL(uLog->PFirst))
+            {
+                link = TOID_IS_NULL(uLog->PLeaf) ? &D_RW(ListHead)->head : &D_RW(uLog->PLeaf)->p_next;
+                if (pmemobj_direct(link->oid) == pmemobj_direct(uLog->PFirst.oid))
+                {
+                    // crashed before unlinking, skip all removed leaves at once
+                    *link = uLog->PAfter;
+                    pmemPersist(link, SIZE_PMEM_POINTER);
+                }
+            }
+        }
+        // unlinked leaves are reclaimed by rebuildLeafPool
+
+        // reset uLog
+        uLog->valid = 0;
+    }
+#endif
+
+bool FPtree::tryBorrowKey(InnerNode* parent, uint64_t receiver_idx, uint64_t sender_idx)
+{
+    InnerNode* sender = reinterpret_cast<InnerNode*> (parent->p_children[sender_idx]);
+    if (sender->nKey <= 1)      // sibling has only 1 key, cannot borrow
+        return false;
+    InnerNode* receiver = reinterpret_cast<InnerNode*> (parent->p_children[receiver_idx]);
+    lockInner(parent);
+    lockInner(sender);
+    lockInner(receiver);
+    if (receiver_idx < sender_idx)  // borrow from right sibling
+    {
+        receiver->addKey(0, parent->keys[receiver_idx], sender->p_children[0]);
+        parent->keys[receiver_idx] = sender->keys[0];
+        sender->removeKey(0, false);
+    }
+    else  // borrow from left sibling
+    {
+        receiver->addKey(0, parent->keys[sender_idx], sender->p_children[sender->nKey], false);
+        parent->keys[sender_idx] = sender->keys[sender->nKey-1];
+        sender->removeKey(sender->nKey-1);
+    }
+    return true;
+}
+
+inline uint64_t FPtree::minKey(BaseNode* node)
+{
+    while (node->isInnerNode)
+        node = reinterpret_cast<InnerNode*> (node)->p_children[0];
+    return reinterpret_cast<LeafNode*> (node)->minKey();
+}
+
+LeafNode* FPtree::minLeaf(BaseNode* node)
+{
+    while(node->isInnerNode)
+        node = reinterpret_cast<InnerNode*> (node)->p_children[0];
+    return reinterpret_cast<LeafNode*> (node);
+}
+
+
+/*
+    Optimistically copy the kvs of leaf with key >= start into out[count..limit) in key order and
+    read its successor into next. Nothing read here can be trusted until the caller validates the
+    leaf version, return false if leaf is inconsistent beyond what copying can cope with.
+*/
+static bool copyLeafRange(LeafNode* leaf, uint64_t start, KV* out, uint64_t& count, uint64_t limit, LeafNode*& next)
+{
+    uint64_t n = leaf->bitmap.count(), slot;
+    const uint8_t* slots = leaf->sortedSlots();
+    KV kv;
+    for (uint64_t pos = 0; pos < n && count < limit; pos++)
+    {
+        if ((slot = slots[pos]) >= MAX_LEAF_SIZE)
+            return false;
+        kv = leaf->kv_pairs[slot];
+        if (kv.key >= start)
+            out[count++] = kv;
+    }
+    #ifdef PMEM
+        next = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid);
+    #else
+        next = leaf->p_next;
+    #endif
+    return true;
+}
+
+/*
+    Leaf aggregators: reduce the values of the kvs of one leaf with lo <= key <= hi, reading kv_pairs
+    in place and masking empty slots with the bitmap. As with copyLeafRange, the result is only
+    meaningful once the caller has validated the leaf version.
+*/
+__attribute__((target("avx512f")))
+static void aggregateLeafAVX512(const KV* kvs, uint64_t bits, uint64_t lo, uint64_t hi, RangeAggregate& agg)
+{
+    // kv pairs are interleaved, gather the keys and values of 8 kvs from two vectors
+    const __m512i even = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+    const __m512i odd = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+    __m512i low = _mm512_set1_epi64(lo), high = _mm512_set1_epi64(hi);
+    __m512i sum = _mm512_setzero_si512(), max_value = _mm512_setzero_si512(), max_key = _mm512_setzero_si512();
+    __m512i min_value = _mm512_set1_epi64(-1);
+    __mmask8 above = 0;
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < MAX_LEAF_SIZE; i += 8)
+    {
+        uint64_t rest = MAX_LEAF_SIZE - i;
+        __mmask8 valid = (bits >> i) & (rest >= 8 ? 0xff : (1 << rest) - 1);
+        if (!valid)
+            continue;
+        // masked loads never touch memory past kv_pairs when MAX_LEAF_SIZE is not a multiple of 8
+        __mmask8 load_lo = rest >= 4 ? 0xff : (1 << (2 * rest)) - 1;
+        __mmask8 load_hi = rest >= 8 ? 0xff : rest > 4 ? (1 << (2 * (rest - 4))) - 1 : 0;
+        __m512i a = _mm512_maskz_loadu_epi64(load_lo, kvs + i);
+        __m512i b = _mm512_maskz_loadu_epi64(load_hi, kvs + i + 4);
+        __m512i keys = _mm512_permutex2var_epi64(a, even, b);
+        __m512i values = _mm512_permutex2var_epi64(a, odd, b);
+        __mmask8 in = _mm512_mask_cmpge_epu64_mask(valid, keys, low) & _mm512_mask_cmple_epu64_mask(valid, keys, high);
+        above |= _mm512_mask_cmpgt_epu64_mask(valid, keys, high);
+        count += __builtin_popcount(in);
+        sum = _mm512_mask_add_epi64(sum, in, sum, values);
+        min_value = _mm512_mask_min_epu64(min_value, in, min_value, values);
+        max_value = _mm512_mask_max_epu64(max_value, in, max_value, values);
+        max_key = _mm512_mask_max_epu64(max_key, in, max_key, keys);
+    }
+    // fold the lanes by hand, the _mm512_reduce_* helpers trip -Wuninitialized in GCC's headers
+    alignas(64) uint64_t lanes[4][8];
+    _mm512_store_si512(lanes[0], sum);
+    _mm512_store_si512(lanes[1], min_value);
+    _mm512_store_si512(lanes[2], max_value);
+    _mm512_store_si512(lanes[3], max_key);
+    agg.count = count;
+    agg.sum = 0;
+    agg.min_value = std::numeric_limits<uint64_t>::max();
+    agg.max_value = agg.max_key = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        agg.sum += lanes[0][i];
+        agg.min_value = std::min(agg.min_value, lanes[1][i]);
+        agg.max_value = std::max(agg.max_value, lanes[2][i]);
+        agg.max_key = std::max(agg.max_key, lanes[3][i]);
+    }
+    agg.past_hi = above != 0;
+}
+
+static void aggregateLeafScalar(const KV* kvs, uint64_t bits, uint64_t lo, uint64_t hi, RangeAggregate& agg)
+{
+    agg = RangeAggregate();
+    for (uint64_t i = 0; i < MAX_LEAF_SIZE; i++)
+    {
+        if (!((bits >> i) & 1))
+            continue;
+        uint64_t key = kvs[i].key, value = kvs[i].value;
+        if (key > hi)
+            agg.past_hi = true;
+        else if (key >= lo)
+        {
+            agg.count++;
+            agg.sum += value;
+            agg.min_value = std::min(agg.min_value, value);
+            agg.max_value = std::max(agg.max_value, value);
+            agg.max_key = std::max(agg.max_key, key);
+        }
+    }
+}
+
+typedef void (*LeafAggregator)(const KV* kvs, uint64_t bits, uint64_t lo, uint64_t hi, RangeAggregate& agg);
+
+static LeafAggregator resolveLeafAggregator()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return aggregateLeafAVX512;
+    return aggregateLeafScalar;
+}
+
+static const LeafAggregator leafAggregator = resolveLeafAggregator();
+
+static inline bool leafUnchanged(LeafNode* leaf, uint64_t version)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return leaf->lockWord().load(std::memory_order_relaxed) == version;
+}
+
+template <typename Read, typename Commit>
+void FPtree::walkLeaves(uint64_t& key, Read&& read, Commit&& commit)
+{
+    EpochGuard epoch_guard;
+    LeafNode* leaf, *prev, *next;
+    uint64_t version, prev_version;
+    bool consistent, resume;
+    #ifdef PMEM
+        uint64_t upper;
+        bool bounded;
+    #endif
+    #ifndef OLC
+        tbb::speculative_spin_rw_mutex::scoped_lock lock_scan;
+    #endif
+    while (true)
+    {
+        // find and read the first leaf, key is past the last leaf committed when resuming
+        #ifdef PMEM
+            if (rebuilding.load(std::memory_order_acquire) && (leaf = lockLeafLazy(key, upper, bounded)) != nullptr)
+            {
+                // no inner nodes yet, read the leaf under its lock and follow the list from there
+                version = leaf->lockWord().load(std::memory_order_relaxed) + 1;
+                consistent = read(leaf, key, next);
+                leaf->Unlock();
+                if (!consistent)
+                    continue;
+            }
+            else
+        #endif
+        {
+        #ifdef OLC
+            if ((leaf = findLeafOptimistic(key, version)) == nullptr)
+                return;
+            consistent = read(leaf, key, next);
+            if (!consistent || !validateLeaf(leaf, version))
+                continue;
+        #else
+            lock_scan.acquire(speculative_lock, false);
+            if ((leaf = findLeaf(key)) == nullptr) { lock_scan.release(); return; }
+            version = leaf->lockWord().load(std::memory_order_acquire);
+            consistent = !(version & 1) && read(leaf, key, next);
+            lock_scan.release();
+            if (!consistent || !leafUnchanged(leaf, version))
+                continue;
+        #endif
+        }
+        if (!commit())
+            return;
+
+        // follow the list without any lock: a leaf whose version changed is read again, a removed
+        // leaf is caught by its predecessor's version (unlinking it locks the predecessor)
+        resume = false;
+        while (!resume && next != nullptr)
+        {
+            prev = leaf; prev_version = version; leaf = next;
+            while ((version = leaf->lockWord().load(std::memory_order_acquire)) & 1 && leafUnchanged(prev, prev_version))
+                _mm_pause();
+            if (!leafUnchanged(prev, prev_version))
+                break;
+            #ifdef PMEM
+                // a leaf no one used since the restart is prepared before it is read
+                if (rebuilding.load(std::memory_order_acquire) && 
+                    !(leaf->lockEntry().lazy_state.load(std::memory_order_acquire) & PREPARED))
+                {
+                    if (leaf->Lock())
+                    {
+                        prepareLeaf(leaf);
+                        leaf->Unlock();
+                    }
+                    next = leaf; leaf = prev; version = prev_version;   // retry this leaf only
+                    continue;
+                }
+            #endif
+            consistent = read(leaf, 0, next);
+            if (!leafUnchanged(prev, prev_version))
+                resume = true;
+            else if (!consistent || !leafUnchanged(leaf, version))
+            {
+                next = leaf; leaf = prev; version = prev_version;   // retry this leaf only
+            }
+            else if (!commit())
+                return;
+        }
+        // list ended, or predecessor changed and a new traversal resumes at key
+        if (next == nullptr && !resume)
+            return;
+    }
+}
+
+template <typename Emit>
+uint64_t FPtree::copyLeaves(uint64_t key, KV* records, uint64_t capacity, bool chunked, Emit&& emit)
+{
+    uint64_t count = 0, saved = 0, total = 0;
+    if (capacity == 0)
+        return 0;
+    walkLeaves(key,
+        [&](LeafNode* leaf, uint64_t start, LeafNode*& next) {
+            count = saved;
+            return copyLeafRange(leaf, start, records, count, capacity, next);
+        },
+        [&]() {
+            uint64_t n = count - saved;
+            bool more = emit(records + saved, n) && (chunked || count < capacity);
+            total += n;
+            if (n)
+            {
+                if (records[count - 1].key == std::numeric_limits<uint64_t>::max())
+                    more = false;
+                key = records[count - 1].key + 1;
+            }
+            saved = count = chunked ? 0 : count;
+            return more;
+        });
+    return total;
+}
+
+uint64_t FPtree::copyRange(uint64_t key, KV* records, uint64_t scan_size, bool one_leaf)
+{
+    return copyLeaves(key, records, scan_size, false, [one_leaf](const KV*, uint64_t n) {
+        return !(one_leaf && n);
+    });
+}
 
-        if( (!TOID_IS_NULL(uLog->PCurrentLeaf)) && (!TOID_IS_NULL(PHead)) )
-        {
-            D_RW(uLog->PLeaf)->p_next = D_RO(uLog->PCurrentLeaf)->p_next;
-            pmemobj_persist(pop, &D_RO(uLog->PLeaf)->p_next, SIZE_PMEM_POINTER);
-            D_RW(uLog->PLeaf)->Unlock();
-            POBJ_FREE(&(uLog->PCurrentLeaf));
-        }
-        else
+
+uint64_t FPtree::rangeScan(uint64_t key, uint64_t scan_size, char* result)
+{
+    return copyRange(key, reinterpret_cast<KV*> (result), scan_size, false);
+}
+
+
+uint64_t FPtree::scanRange(uint64_t lo, uint64_t hi, uint64_t limit, const std::function<bool(const ScanChunk&)>& visitor,
+                           const ScanOptions& options)
+{
+    KV records[MAX_LEAF_SIZE];
+    uint64_t keys[MAX_LEAF_SIZE], values[MAX_LEAF_SIZE];
+    uint64_t emitted = 0;
+    ScanChunk chunk;
+    if (lo > hi || limit == 0)
+        return 0;
+    chunk.kvs = options.output == ScanKV ? records : nullptr;
+    chunk.keys = options.output == ScanKeys || options.output == ScanColumns ? keys : nullptr;
+    chunk.values = options.output == ScanValues || options.output == ScanColumns ? values : nullptr;
+    copyLeaves(lo, records, MAX_LEAF_SIZE, true, [&](const KV* copied, uint64_t n) {
+        uint64_t count = 0, i;
+        bool past_hi = false;
+        for (i = 0; i < n && emitted + count < limit; i++)
         {
-            if ( (!TOID_IS_NULL(uLog->PCurrentLeaf)) && 
-                ((struct LeafNode *) pmemobj_direct((uLog->PCurrentLeaf).oid) == 
-                (struct LeafNode *) pmemobj_direct(PHead.oid)) 
-            )
+            if (copied[i].key > hi) { past_hi = true; break; }
+            if ((options.key_filter && !options.key_filter(copied[i].key)) ||
+                (options.value_filter && !options.value_filter(copied[i].value)))
+                continue;
+            switch (options.output)
             {
-                PHead = D_RO(uLog->PCurrentLeaf)->p_next; 
-                pmemobj_persist(pop, &PHead, SIZE_PMEM_POINTER);
-                POBJ_FREE(&(uLog->PCurrentLeaf));
-            }
-            else 
-            {
-                if ( (!TOID_IS_NULL(uLog->PCurrentLeaf)) && 
-                    ((struct LeafNode *) pmemobj_direct((D_RO(uLog->PCurrentLeaf)->p_next).oid) == 
-                    (struct LeafNode *) pmemobj_direct(PHead.oid)) 
-                )
-                    POBJ_FREE(&(uLog->PCurrentLeaf));
-                else { /* reset uLog */ }
+                case ScanKV: records[count] = copied[i]; break;     // compacts in place, count <= i
+                case ScanKeys: keys[count] = copied[i].key; break;
+                case ScanValues: values[count] = copied[i].value; break;
+                case ScanColumns: keys[count] = copied[i].key; values[count] = copied[i].value; break;
             }
+            count++;
         }
+        emitted += count;
+        chunk.count = count;
+        if (count && !visitor(chunk))
+            return false;
+        return !past_hi && emitted < limit;
+    });
+    return emitted;
+}
 
-        // reset uLog
-        uLog->PCurrentLeaf = OID_NULL;
-        uLog->PLeaf = OID_NULL;
+
+void FPtree::aggregateRange(uint64_t lo, uint64_t hi, RangeAggregate& total)
+{
+    RangeAggregate part;
+    uint64_t key = lo;
+    total = RangeAggregate();
+    if (lo > hi)
         return;
-    }
-#endif
+    walkLeaves(key,
+        [&](LeafNode* leaf, uint64_t start, LeafNode*& next) {
+            leafAggregator(leaf->kv_pairs, leaf->bitmap.bits, start, hi, part);
+            #ifdef PMEM
+                next = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid);
+            #else
+                next = leaf->p_next;
+            #endif
+            return true;
+        },
+        [&]() {
+            total.count += part.count;
+            total.sum += part.sum;
+            total.min_value = std::min(total.min_value, part.min_value);
+            total.max_value = std::max(total.max_value, part.max_value);
+            if (part.count)
+            {
+                if (part.max_key == std::numeric_limits<uint64_t>::max())
+                    return false;
+                key = part.max_key + 1;
+            }
+            return !part.past_hi;
+        });
+}
 
-bool FPtree::tryBorrowKey(InnerNode* parent, uint64_t receiver_idx, uint64_t sender_idx)
+uint64_t FPtree::countRange(uint64_t lo, uint64_t hi)
 {
-    InnerNode* sender = reinterpret_cast<InnerNode*> (parent->p_children[sender_idx]);
-    if (sender->nKey <= 1)      // sibling has only 1 key, cannot borrow
+    RangeAggregate agg;
+    aggregateRange(lo, hi, agg);
+    return agg.count;
+}
+
+uint64_t FPtree::sumRange(uint64_t lo, uint64_t hi)
+{
+    RangeAggregate agg;
+    aggregateRange(lo, hi, agg);
+    return agg.sum;
+}
+
+bool FPtree::minMaxRange(uint64_t lo, uint64_t hi, uint64_t& min_value, uint64_t& max_value)
+{
+    RangeAggregate agg;
+    aggregateRange(lo, hi, agg);
+    if (agg.count == 0)
         return false;
-    InnerNode* receiver = reinterpret_cast<InnerNode*> (parent->p_children[receiver_idx]);
-    if (receiver_idx < sender_idx)  // borrow from right sibling
-    {
-        receiver->addKey(0, parent->keys[receiver_idx], sender->p_children[0]);
-        parent->keys[receiver_idx] = sender->keys[0];
-        sender->removeKey(0, false);
-    }
-    else  // borrow from left sibling
-    {
-        receiver->addKey(0, receiver->keys[0], sender->p_children[sender->nKey], false);
-        parent->keys[sender_idx] = sender->keys[sender->nKey-1];
-        sender->removeKey(sender->nKey-1);
-    }
+    min_value = agg.min_value;
+    max_value = agg.max_value;
     return true;
 }
 
-inline uint64_t FPtree::minKey(BaseNode* node)
+FPtree::Cursor::Cursor(FPtree& tree, uint64_t key)
 {
-    while (node->isInnerNode)
-        node = reinterpret_cast<InnerNode*> (node)->p_children[0];
-    return reinterpret_cast<LeafNode*> (node)->minKey();
+    this->tree = &tree;
+    seek(key);
 }
 
-LeafNode* FPtree::minLeaf(BaseNode* node)
+void FPtree::Cursor::seek(uint64_t key)
 {
-    while(node->isInnerNode)
-        node = reinterpret_cast<InnerNode*> (node)->p_children[0];
-    return reinterpret_cast<LeafNode*> (node);
+    this->next_key = key;
+    this->size = this->pos = 0;
+    this->exhausted = false;
 }
 
-
-void FPtree::sortKV()
+bool FPtree::Cursor::refill()
 {
-    uint64_t j = 0;
-    for (uint64_t i = 0; i < MAX_LEAF_SIZE; i++)
-        if (this->current_leaf->bitmap.test(i))
-            this->volatile_current_kv[j++] = this->current_leaf->kv_pairs[i];
-    
-    this->size_volatile_kv = j;
+    if (this->exhausted)
+        return false;
+    this->pos = 0;
+    this->size = tree->copyRange(this->next_key, this->buffer, MAX_LEAF_SIZE, true);
+    advance(this->buffer, this->size);
+    return this->size != 0;
+}
 
-    std::sort(std::begin(this->volatile_current_kv), std::begin(this->volatile_current_kv) + this->size_volatile_kv, 
-    [] (const KV& kv1, const KV& kv2){
-        return kv1.key < kv2.key;
-    });
+inline void FPtree::Cursor::advance(const KV* copied, uint64_t n)
+{
+    if (n == 0 || copied[n - 1].key == std::numeric_limits<uint64_t>::max())
+        this->exhausted = true;
+    else
+        this->next_key = copied[n - 1].key + 1;
 }
 
+bool FPtree::Cursor::next(KV& kv)
+{
+    if (this->pos == this->size && !refill())
+        return false;
+    kv = this->buffer[this->pos++];
+    return true;
+}
 
-void FPtree::scanInitialize(uint64_t key)
+uint64_t FPtree::Cursor::nextBatch(KV* out, uint64_t n)
 {
-    if (!root)
-        return;
+    uint64_t count = std::min(n, this->size - this->pos), copied;
+    std::copy(this->buffer + this->pos, this->buffer + this->pos + count, out);
+    this->pos += count;
+    if (count == n || this->exhausted)
+        return count;
+    // buffer is drained, copy the rest straight into out
+    copied = tree->copyRange(this->next_key, out + count, n - count, false);
+    advance(out + count, copied);
+    return count + copied;
+}
+
 
-    this->current_leaf = root->isInnerNode? findLeaf(key) : reinterpret_cast<LeafNode*> (root);
-    while (this->current_leaf != nullptr)
+
+BaseNode* FPtree::buildInnerLevels(std::vector<BaseNode*> level, std::vector<uint64_t> min_keys, 
+                                   float load_factor, unsigned num_threads)
+{
+    // at least 3 children so that spreading them evenly never leaves a node with a single child
+    uint64_t fanout = std::min<uint64_t>(MAX_INNER_SIZE + 1, std::max<uint64_t>(3, load_factor * (MAX_INNER_SIZE + 1)));
+    while (level.size() > 1)
     {
-        this->sortKV();
-        for (uint64_t i = 0; i < this->size_volatile_kv; i++)
+        size_t n = level.size(), count = (n + fanout - 1) / fanout;
+        std::vector<BaseNode*> parents(count);
+        std::vector<uint64_t> parent_keys(count);
+        parallelFor(count, num_threads, [&] (size_t begin, size_t end)
         {
-            if (this->volatile_current_kv[i].key >= key)
+            for (size_t i = begin; i < end; i++)
             {
-                this->bitmap_idx = i;
-                return;
+                size_t first = n * i / count, last = n * (i + 1) / count;
+                InnerNode* node = new InnerNode();
+                for (size_t j = first; j < last; j++)
+                {
+                    node->p_children[j - first] = level[j];
+                    if (j > first)
+                        node->keys[j - first - 1] = min_keys[j];
+                }
+                node->nKey = last - first - 1;
+                parents[i] = node;
+                parent_keys[i] = min_keys[first];
             }
-        }
-        #ifdef PMEM
-            this->current_leaf = (struct LeafNode *) pmemobj_direct((this->current_leaf->p_next).oid);
-        #else
-            this->current_leaf = this->current_leaf->p_next;
-        #endif
+        });
+        level.swap(parents);
+        min_keys.swap(parent_keys);
     }
+    return level.empty() ? nullptr : level[0];
 }
 
-
-KV FPtree::scanNext()
+// Fill leaves with kvs[begin, end) in key order, per_leaf records each, and link them. Of equal keys
+// the first is kept. Return number of records written, 0 with leaves empty if the pool ran out of leaves.
+static uint64_t buildLeaves(const KV* kvs, size_t begin, size_t end, uint64_t per_leaf, 
+                            std::vector<BaseNode*>& leaves, std::vector<uint64_t>& min_keys)
 {
-    assert(this->current_leaf != nullptr && "Current scan node was deleted!");
-    struct KV kv = this->volatile_current_kv[this->bitmap_idx++];
-    if (this->bitmap_idx == this->size_volatile_kv)
+    uint64_t written = 0, count;
+    #ifdef PMEM
+        // a leaf is assembled in DRAM and streamed out once its successor is known, one write per leaf
+        LeafNode staging, *leaf = nullptr;
+    #endif
+    size_t i = begin;
+    while (true)
     {
+        while (i < end && i > begin && kvs[i].key == kvs[i - 1].key)
+            i++;
+        if (i == end)
+            break;
         #ifdef PMEM
-            this->current_leaf = (struct LeafNode *) pmemobj_direct((this->current_leaf->p_next).oid);
+            LeafNode* next = allocLeaf();
+            if (next == nullptr)    // none of the leaves is linked into the tree yet, hand them all back
+            {
+                for (BaseNode* node : leaves)
+                    freeLeaf(reinterpret_cast<LeafNode*> (node));
+                leaves.clear();
+                min_keys.clear();
+                return 0;
+            }
+            if (leaf != nullptr)
+            {
+                staging.p_next = pmemobj_oid(next);
+                pmemCopyNT(leaf, &staging, sizeof(LeafNode));
+            }
+            leaf = next;
+            leaf->resetVersion(false);
+            LeafNode* node = &staging;
+            node->lock_id = leaf->lock_id;
         #else
-            this->current_leaf = this->current_leaf->p_next;
+            LeafNode* leaf = new LeafNode(), *node = leaf;
+            if (!leaves.empty())
+                reinterpret_cast<LeafNode*> (leaves.back())->p_next = leaf;
         #endif
-        if (this->current_leaf != nullptr)
+        uint8_t* slots = node->sortedSlots();
+        for (count = 0; i < end && count < per_leaf; i++)
         {
-            this->sortKV();
-            this->bitmap_idx = 0;
+            if (i > begin && kvs[i].key == kvs[i - 1].key)
+                continue;
+            node->kv_pairs[count] = kvs[i];
+            node->fingerprints[count] = getOneByteHash(kvs[i].key);
+            slots[count] = count;
+            count++;
         }
+        node->isInnerNode = false;
+        node->bitmap.bits = count == 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+        leaves.push_back(leaf);
+        min_keys.push_back(node->kv_pairs[0].key);
+        written += count;
     }
-    return kv;
+    #ifdef PMEM
+        if (leaf != nullptr)
+        {
+            staging.p_next = TOID_NULL(struct LeafNode);
+            pmemCopyNT(leaf, &staging, sizeof(LeafNode));
+        }
+        pmemFence();
+    #endif
+    return written;
 }
 
-
-bool FPtree::scanComplete()
+uint64_t FPtree::bulkBuild(const KV* kvs, size_t n, float load_factor, unsigned num_threads)
 {
-    return this->current_leaf == nullptr;
-}
+    #ifdef PMEM
+        awaitIndex();
+    #endif
+    if (n == 0 || root != nullptr || !std::is_sorted(kvs, kvs + n, [] (const KV& kv1, const KV& kv2) {
+            return kv1.key < kv2.key;
+        }))
+        return 0;
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    uint64_t per_leaf = std::min<uint64_t>(MAX_LEAF_SIZE, std::max<uint64_t>(1, load_factor * MAX_LEAF_SIZE));
 
+    // key partitions are built on their own threads, a partition never starts inside a run of equal keys
+    struct Partition
+    {
+        size_t begin;
+        uint64_t written;
+        std::vector<BaseNode*> leaves;
+        std::vector<uint64_t> min_keys;
+    };
+    std::vector<Partition> partitions;
+    std::mutex partitions_lock;
+    bool failed = false;
+    parallelFor(n, num_threads, [&] (size_t begin, size_t end)
+    {
+        auto boundary = [&] (size_t i) {
+            while (i > 0 && i < n && kvs[i].key == kvs[i - 1].key)
+                i++;
+            return i;
+        };
+        Partition partition;
+        partition.begin = boundary(begin);
+        partition.written = buildLeaves(kvs, partition.begin, boundary(end), per_leaf, partition.leaves, partition.min_keys);
+        std::lock_guard<std::mutex> guard(partitions_lock);
+        if (partition.leaves.empty() && partition.begin < boundary(end))
+            failed = true;
+        if (!partition.leaves.empty())
+            partitions.push_back(std::move(partition));
+    });
+    if (failed)     // out of leaves, the tree stays empty
+    {
+        #ifdef PMEM
+            for (Partition& partition : partitions)
+                for (BaseNode* node : partition.leaves)
+                    freeLeaf(reinterpret_cast<LeafNode*> (node));
+        #endif
+        return 0;
+    }
+    std::sort(partitions.begin(), partitions.end(), [] (const Partition& p1, const Partition& p2) {
+        return p1.begin < p2.begin;
+    });
 
-uint64_t FPtree::rangeScan(uint64_t key, uint64_t scan_size, char* result)
-{
-    LeafNode* leaf, * next_leaf;
-    std::vector<KV> records;
-    records.reserve(scan_size);
-    uint64_t i;
-    tbb::speculative_spin_rw_mutex::scoped_lock lock_scan;
-    while (true) 
-    {
-        lock_scan.acquire(speculative_lock, false);
-        if ((leaf = findLeaf(key)) == nullptr) { lock_scan.release(); return 0; }
-        if (!leaf->Lock()) { lock_scan.release(); continue; }
-        for (i = 0; i < MAX_LEAF_SIZE; i++)
-            if (leaf->bitmap.test(i) && leaf->kv_pairs[i].key >= key)
-                records.push_back(leaf->kv_pairs[i]);
-        while (records.size() < scan_size)
+    std::vector<BaseNode*> leaves;
+    std::vector<uint64_t> min_keys;
+    uint64_t written = 0;
+    for (Partition& partition : partitions)
+    {
+        if (!leaves.empty())
         {
+            LeafNode* tail = reinterpret_cast<LeafNode*> (leaves.back());
             #ifdef PMEM
-                if (TOID_IS_NULL(leaf->p_next))
-                    break;
-                next_leaf = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid);
+                tail->p_next = pmemobj_oid(partition.leaves.front());
+                pmemPersist(&tail->p_next, SIZE_PMEM_POINTER);
             #else
-                if ((next_leaf = leaf->p_next) == nullptr)
-                    break;
+                tail->p_next = reinterpret_cast<LeafNode*> (partition.leaves.front());
             #endif
-            while (!next_leaf->Lock())
-                std::this_thread::sleep_for(std::chrono::nanoseconds(1));
-            leaf->Unlock();
-            leaf = next_leaf;
-            for (i = 0; i < MAX_LEAF_SIZE; i++)
-                if (leaf->bitmap.test(i))
-                    records.push_back(leaf->kv_pairs[i]);
         }
-        lock_scan.release();
-        break;
+        leaves.insert(leaves.end(), partition.leaves.begin(), partition.leaves.end());
+        min_keys.insert(min_keys.end(), partition.min_keys.begin(), partition.min_keys.end());
+        written += partition.written;
     }
-    if (leaf && leaf->lock == 1)
-        leaf->Unlock();
-    std::sort(records.begin(), records.end(), [] (const KV& kv1, const KV& kv2) {
-            return kv1.key < kv2.key;
-    });
-    // result = new char[sizeof(KV) * records.size()];
-    i = records.size() > scan_size ? scan_size : records.size();
-    memcpy(result, records.data(), sizeof(KV) * i);
-    return i;
+
+    BaseNode* new_root = buildInnerLevels(leaves, min_keys, load_factor, num_threads);
+    #ifdef PMEM
+        // the leaves become part of the tree with this single store, before it they are unreachable
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        D_RW(ListHead)->head = pmemobj_oid(leaves.front());
+        pmemPersist(&D_RO(ListHead)->head, SIZE_PMEM_POINTER);
+    #endif
+    __atomic_store_n(&root, new_root, __ATOMIC_RELEASE);
+    return written;
+}
+
+uint64_t FPtree::mergeLeaf(LeafNode* leaf, const KV* kvs, size_t n, std::vector<std::pair<uint64_t, LeafNode*>>& splits)
+{
+    uint64_t count = leaf->bitmap.count(), total = count + n;
+    if (total <= MAX_LEAF_SIZE)
+        return applyLeafBatch(leaf, kvs, n, false);
+    // leaf and the new leaves share all records evenly, leaf keeps the lowest ones
+    uint64_t parts = (total + MAX_LEAF_SIZE - 1) / MAX_LEAF_SIZE, keep = (total + parts - 1) / parts;
+    uint64_t moved = 0, slot;
+    const uint8_t* slots = leaf->sortedSlots();
+    std::vector<KV> low, high;
+    for (size_t a = 0, b = 0; a < count || b < n; )
+    {
+        bool from_leaf = b == n || (a < count && leaf->kv_pairs[slots[a]].key < kvs[b].key);
+        std::vector<KV>& part = a + b < keep ? low : high;
+        if (!from_leaf)
+            part.push_back(kvs[b++]);
+        else if (&part == &high)
+        {
+            slot = slots[a++];
+            high.push_back(leaf->kv_pairs[slot]);
+            moved |= (uint64_t)1 << slot;
+        }
+        else
+            a++;
+    }
+
+    std::vector<BaseNode*> leaves;
+    std::vector<uint64_t> min_keys;
+    buildLeaves(high.data(), 0, high.size(), (high.size() + parts - 2) / (parts - 1), leaves, min_keys);
+    if (leaves.empty())     // out of leaves, leaf is unchanged
+        return 0;
+    for (BaseNode* node : leaves)
+        while (!reinterpret_cast<LeafNode*> (node)->Lock());    // unreachable so far, locked until posted
+    #ifdef PMEM
+        for (size_t i = 0; i < leaves.size(); i++)
+            markLeafPrepared(reinterpret_cast<LeafNode*> (leaves[i]), min_keys[i]);
+    #endif
+    LeafNode* first = reinterpret_cast<LeafNode*> (leaves.front());
+    LeafNode* last = reinterpret_cast<LeafNode*> (leaves.back());
+
+    // same protocol as splitLeaf with NewLeaf being the first new leaf, the others hang off it
+    #ifdef PMEM
+        last->p_next = leaf->p_next;
+        pmemPersist(&last->p_next, sizeof(last->p_next));
+
+        Log* log = &threadLogSlot()->split;
+        log->PCurrentLeaf = pmemobj_oid(leaf);
+        pmemPersist(&(log->PCurrentLeaf), SIZE_PMEM_POINTER);
+        log->PLeaf = pmemobj_oid(first);
+        pmemPersist(&(log->PLeaf), SIZE_PMEM_POINTER);
+
+        leaf->p_next = pmemobj_oid(first);
+        pmemPersist(&leaf->p_next, sizeof(leaf->p_next));
+
+        leaf->removeSortedSlots(moved);
+        leaf->bitmap.bits &= ~moved;
+        pmemPersist(&leaf->bitmap, sizeof(leaf->bitmap));
+
+        log->PCurrentLeaf = OID_NULL;
+        log->PLeaf = OID_NULL;
+        pmemPersist(&(log->PCurrentLeaf), SIZE_PMEM_POINTER);
+        pmemPersist(&(log->PLeaf), SIZE_PMEM_POINTER);
+    #else
+        last->p_next = leaf->p_next;
+        leaf->p_next = first;
+        leaf->removeSortedSlots(moved);
+        leaf->bitmap.bits &= ~moved;
+    #endif
+
+    // the new records staying in leaf go to the slots just freed
+    applyLeafBatch(leaf, low.data(), low.size(), false);
+    for (size_t i = 0; i < leaves.size(); i++)
+        splits.push_back(std::make_pair(min_keys[i], reinterpret_cast<LeafNode*> (leaves[i])));
+    return n;
+}
+
+LeafNode* FPtree::lockNextLeaf(LeafNode* leaf, uint64_t& upper, bool& bounded)
+{
+    LeafNode* next, *after;
+    uint64_t version;
+    #ifdef PMEM
+        if (rebuilding.load(std::memory_order_acquire))     // separators are not min keys until the rebuild is done
+            return nullptr;
+        next = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid);
+    #else
+        next = leaf->p_next;
+    #endif
+    if (next == nullptr || !next->Lock())
+        return nullptr;
+    #ifdef PMEM
+        after = (struct LeafNode *) pmemobj_direct((next->p_next).oid);
+    #else
+        after = next->p_next;
+    #endif
+    if ((bounded = after != nullptr))
+    {
+        // after stays linked while next is locked, and its min key, which is its separator, only changes
+        // under its lock
+        version = after->lockWord().load(std::memory_order_acquire);
+        if (!(version & 1) && after->bitmap.count() != 0)
+        {
+            upper = after->kv_pairs[after->sortedSlots()[0]].key;
+            if (leafUnchanged(after, version))
+                return next;
+        }
+        next->Unlock();
+        return nullptr;
+    }
+    return next;
 }
 
+uint64_t FPtree::mergeSorted(const KV* kvs, size_t n)
+{
+    EpochGuard epoch_guard;
+    if (!std::is_sorted(kvs, kvs + n, [] (const KV& kv1, const KV& kv2) { return kv1.key < kv2.key; }))
+        return 0;
+
+    std::vector<std::pair<uint64_t, LeafNode*>> splits;
+    std::vector<KV> fresh;
+    LeafNode* leaf = nullptr, *next;
+    uint64_t upper = 0, merged = 0;
+    bool bounded = false;
+    size_t i = 0, j;
+    while (i < n)
+    {
+        if (leaf == nullptr && (leaf = lockLeaf(kvs[i].key, upper, bounded)) == nullptr)
+        {
+            merged += insert(kvs[i++]);     // empty tree, let insert create the root
+            continue;
+        }
+
+        // leaf is locked, so its key range cannot change
+        fresh.clear();
+        for (j = i; j < n && (!bounded || kvs[j].key < upper); j++)
+        {
+            if ((j > i && kvs[j].key == kvs[j - 1].key) || leaf->findKVIndex(kvs[j].key) != MAX_LEAF_SIZE)
+                continue;
+            fresh.push_back(kvs[j]);
+        }
+        i = j;
+
+        // lock the leaf after leaf before the split, the new leaves end up in between
+        next = i < n && bounded ? lockNextLeaf(leaf, upper, bounded) : nullptr;
+        splits.clear();
+        merged += mergeLeaf(leaf, fresh.data(), fresh.size(), splits);
+        #ifdef PMEM
+            deferSplits(splits);
+        #endif
+        if (!splits.empty())
+        {
+            tbb::speculative_spin_rw_mutex::scoped_lock lock_merge;
+            /*---------------- Critical Section -----------------*/
+            acquireSMO(lock_merge);
+            updateInnerParents(leaf, splits);
+            for (auto& split : splits)
+                split.second->Unlock();
+            releaseSMO(lock_merge);
+            /*---------------- End of Critical Section -----------------*/
+        }
+        leaf->Unlock();
 
+        // go on in next if the next record falls into it, through the inner nodes otherwise. The separator
+        // of next may have grown since upper was read, under its lock it is its min key
+        if ((leaf = next) != nullptr && 
+            (kvs[i].key < leaf->kv_pairs[leaf->sortedSlots()[0]].key || (bounded && kvs[i].key >= upper)))
+        {
+            leaf->Unlock();
+            leaf = nullptr;
+        }
+    }
+    return merged;
+}
 
 #ifdef PMEM
-    bool FPtree::bulkLoad(float load_factor = 1)
+    bool FPtree::bulkLoad(float load_factor, unsigned num_threads)
     {
         TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
-        TOID(struct LeafNode) cursor = D_RW(ListHead)->head;
+        TOID(struct LeafNode)* link = &D_RW(ListHead)->head;
+        std::vector<BaseNode*> leaves;
+
+        // the chain is followed on this thread, everything done per leaf runs in parallel afterwards
+        while (!TOID_IS_NULL(*link))
+        {
+            LeafNode* leaf = D_RW(*link);
+            if (leaf->bitmap.count() == 0)  // every leaf needs a min key, drop an empty one from the list
+            {
+                *link = leaf->p_next;
+                pmemPersist(link, SIZE_PMEM_POINTER);
+                continue;
+            }
+            leaves.push_back(leaf);
+            link = &leaf->p_next;
+        }
+
+        if (num_threads == 0)
+            num_threads = std::thread::hardware_concurrency();
+        std::vector<uint64_t> min_keys(leaves.size());
+        parallelFor(leaves.size(), num_threads, [&] (size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                LeafNode* leaf = reinterpret_cast<LeafNode*> (leaves[i]);
+                leaf->rebuildFingerprints();
+                leaf->sortSlots();
+                min_keys[i] = leaf->kv_pairs[leaf->sortedSlots()[0]].key;
+            }
+        });
+        rebuildLeafPool(leaves, num_threads);
+        this->root = buildInnerLevels(leaves, min_keys, load_factor, num_threads);
+        return true;
+    }
+    LeafNode* FPtree::lockLeafLazy(uint64_t key, uint64_t& upper, bool& bounded)
+    {
+        const SparseEntry* first = sparse_index.get();
+        const SparseEntry* entry = std::upper_bound(first, first + sparse_size.load(std::memory_order_acquire), key,
+                                                    [] (uint64_t k, const SparseEntry& e) { return k < e.key; });
+        LeafNode* leaf = entry == first ? firstLeaf(D_RO(POBJ_ROOT(pop, struct List))->head) : (entry - 1)->leaf;
+        LeafNode* next;
 
-        if (TOID_IS_NULL(cursor)) { this->root = nullptr; return true; }
+        // no leaf is removed before root is published and split leaves are linked in place, so the list
+        // can be followed without locks
+        while ((next = firstLeaf(leaf->p_next)) != nullptr && lowKey(next) <= key)
+            leaf = next;
 
-        if (TOID_IS_NULL(D_RO(cursor)->p_next)) 
-            { root = (struct BaseNode *) pmemobj_direct(cursor.oid); return true;}
+        while (true)
+        {
+            while (!leaf->Lock())
+            {
+                if (!rebuilding.load(std::memory_order_acquire))
+                    return nullptr;
+                std::this_thread::yield();
+            }
+            // once root is published the leaf may have been split, go through the inner nodes instead
+            if (!rebuilding.load(std::memory_order_acquire))
+            {
+                leaf->Unlock();
+                return nullptr;
+            }
+            // leaf may have been split since we passed it, its list pointer is stable while we hold it
+            if ((next = firstLeaf(leaf->p_next)) == nullptr || (upper = lowKey(next)) > key)
+                break;
+            leaf->Unlock();
+            leaf = next;
+        }
+        bounded = next != nullptr;
+        prepareLeaf(leaf);
+        lowKey(leaf);   // a leaf in use keeps its place in the new index, even if it is emptied meanwhile
+        return leaf;
+    }
 
+    void FPtree::rebuildIndex()
+    {
+        TOID(struct List) ListHead = POBJ_ROOT(pop, struct List);
+        std::vector<BaseNode*> leaves, empty;
         std::vector<uint64_t> min_keys;
-        std::vector<LeafNode*> child_nodes;
-        uint64_t total_leaves = 0;
-        LeafNode* temp_leafnode;
-        while(!TOID_IS_NULL(cursor))   // record min keys and leaf nodes 
+        size_t sparse_capacity = rebuild_groups * LEAF_GROUP_SIZE / SPARSE_INDEX_STRIDE + 1;
+        for (TOID(struct LeafNode) cursor = D_RO(ListHead)->head; !TOID_IS_NULL(cursor); cursor = D_RO(cursor)->p_next)
         {
-            temp_leafnode = (struct LeafNode *) pmemobj_direct(cursor.oid);
-            child_nodes.push_back(temp_leafnode);
-            min_keys.push_back(temp_leafnode->minKey());
-            cursor = D_RW(cursor)->p_next;
+            LeafNode* leaf = D_RW(cursor);
+            LeafLock& entry = leaf->lockEntry();
+            // an empty leaf without a low key is passed over by every lookup, so it stays empty
+            if (!(entry.lazy_state.load(std::memory_order_acquire) & LOW_KEY_SET) && leaf->bitmap.count() == 0)
+            {
+                empty.push_back(leaf);
+                continue;
+            }
+            // a leaf locked by a foreground op is prepared by it before use
+            while (!(leaf->lockEntry().lazy_state.load(std::memory_order_acquire) & PREPARED))
+            {
+                if (leaf->Lock())
+                {
+                    prepareLeaf(leaf);
+                    leaf->Unlock();
+                }
+                else
+                    std::this_thread::yield();
+            }
+            leaves.push_back(leaf);
+            min_keys.push_back(lowKey(leaf));
+            entry.lazy_state.fetch_or(INDEXED, std::memory_order_relaxed);
+            // sparse_index is sized for the leaves there were at the start, leaves split off since are
+            // reached through the list
+            if (leaves.size() % SPARSE_INDEX_STRIDE == 0 && leaves.size() / SPARSE_INDEX_STRIDE <= sparse_capacity)
+            {
+                size_t n = sparse_size.load(std::memory_order_relaxed);
+                sparse_index[n] = SparseEntry{min_keys.back(), leaf};
+                sparse_size.store(n + 1, std::memory_order_release);
+            }
         }
-        total_leaves = min_keys.size();
-        min_keys.erase(min_keys.begin());
 
-        InnerNode* new_root = new InnerNode();
-        uint64_t idx = 0;
-        uint64_t root_size = total_leaves <= MAX_INNER_SIZE ? 
-                             total_leaves : MAX_INNER_SIZE + 1;
-        for (; idx < root_size; idx++)     // recovery the root node
-        {   
-            if (idx < root_size - 1)
-                new_root->keys[idx] = min_keys[idx];
-            new_root->p_children[idx] = child_nodes[idx];
+        unsigned num_threads = std::thread::hardware_concurrency();
+        BaseNode* new_root = buildInnerLevels(leaves, min_keys, 1, num_threads);
+
+        // lookups step over empty leaves, unlink them and hand them back once no lookup can be on one.
+        // Splits still change the list, so the leaf in front is locked like for any other unlink
+        TOID(struct LeafNode)* link = &D_RW(ListHead)->head;
+        LeafNode* prev = nullptr;
+        for (size_t i = 0; i < empty.size(); )
+        {
+            LeafNode* leaf = D_RW(*link);
+            if (leaf != empty[i])
+            {
+                prev = leaf;
+                link = &leaf->p_next;
+                continue;
+            }
+            while (prev && !prev->Lock())
+                std::this_thread::yield();
+            if (prev && D_RW(*link) != leaf)    // prev was split, go on from the new leaf
+            {
+                prev->Unlock();
+                continue;
+            }
+            *link = leaf->p_next;
+            pmemPersist(link, SIZE_PMEM_POINTER);
+            if (prev)
+                prev->Unlock();
+            i++;
         }
-        new_root->nKey = root_size - 1;
-        this->root = reinterpret_cast<BaseNode*> (new_root);
+        std::vector<BaseNode*> in_use(leaves);
+        in_use.insert(in_use.end(), empty.begin(), empty.end());
+        rebuildLeafPool(in_use, num_threads, rebuild_groups);
 
-        if (total_leaves > MAX_INNER_SIZE)
+        // structure modifications wait for rebuilding to clear and splits queue up under rebuild_lock,
+        // so the new index is ours until the queued separators are in
         {
-            idx--;
-            right_most_innnerNode = reinterpret_cast<InnerNode*>(this->root); 
-            for (; idx < min_keys.size(); idx++)   // Index entries for leaf pages always entered into right-most index page
+            std::lock_guard<std::mutex> guard(rebuild_lock);
+            tbb::speculative_spin_rw_mutex::scoped_lock lock_publish;
+            #ifdef OLC
+                smo_lock.lock();
+            #else
+                lock_publish.acquire(speculative_lock, true);
+            #endif
+            __atomic_store_n(&root, new_root, __ATOMIC_RELEASE);
+            for (auto& split : pending_splits)
             {
-                findLeafAndPushInnerNodes(min_keys[idx]);
-                right_most_innnerNode = stack_innerNodes.pop();
-                updateParents(min_keys[idx], right_most_innnerNode, child_nodes[idx+1]);
+                // root is a leaf only while it is the one leaf indexed, the left neighbour of any split
+                if (!(split.second->lockEntry().lazy_state.load(std::memory_order_relaxed) & INDEXED))
+                    updateInnerParents(reinterpret_cast<LeafNode*> (root), split.second, split.first);
             }
+            pending_splits.clear();
+            releaseSMO(lock_publish);
+            rebuilding.store(false, std::memory_order_release);
         }
-        return true;
+        rebuild_done.notify_all();
+        for (BaseNode* leaf : empty)
+            Epoch::retire(leaf, deleteLeaf);
+    }
+
+    void FPtree::deferSplits(std::vector<std::pair<uint64_t, LeafNode*>>& splits)
+    {
+        splits.erase(std::remove_if(splits.begin(), splits.end(), [this] (std::pair<uint64_t, LeafNode*>& split) {
+            if (!deferSplit(split.first, split.second))
+                return false;
+            split.second->Unlock();
+            return true;
+        }), splits.end());
+    }
+
+    bool FPtree::deferSplit(uint64_t splitKey, LeafNode* leaf)
+    {
+        LeafLock& entry = leaf->lockEntry();
+        if (!rebuilding.load(std::memory_order_acquire) && !(entry.lazy_state.load(std::memory_order_relaxed) & INDEXED))
+            return false;
+        std::lock_guard<std::mutex> guard(rebuild_lock);
+        if (rebuilding.load(std::memory_order_relaxed))
+        {
+            pending_splits.push_back(std::make_pair(splitKey, leaf));
+            return true;
+        }
+        return entry.lazy_state.load(std::memory_order_relaxed) & INDEXED;
+    }
+
+    void FPtree::awaitIndex()
+    {
+        if (!rebuilding.load(std::memory_order_acquire))
+            return;
+        std::unique_lock<std::mutex> guard(rebuild_lock);
+        rebuild_done.wait(guard, [this] { return !rebuilding.load(std::memory_order_acquire); });
     }
 #endif
 
@@ -1326,10 +4215,10 @@ uint64_t rdtsc(){
         std::cout << "\nEnter the key to initialize scan: "; 
         std::cin >> key;
         std::cout << std::endl;
-        fptree.scanInitialize(key);
-        while(!fptree.scanComplete())
+        FPtree::Cursor cursor(fptree, key);
+        KV kv;
+        while(cursor.next(kv))
         {
-            KV kv = fptree.scanNext();
             std::cout << kv.key << "," << kv.value << " ";
         }
         std::cout << std::endl;
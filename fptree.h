@@ -39,8 +39,11 @@
 #include <functional>
 #include <cassert>
 #include <thread>
-#include <boost/lockfree/queue.hpp>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifdef TEST_MODE
     #define MAX_INNER_SIZE 3
@@ -49,7 +52,11 @@
     #define SIZE_PMEM_POINTER 16
 #else
     #define MAX_INNER_SIZE 128
-    #define MAX_LEAF_SIZE 64
+    #ifdef LEAF_HEADER_LINE
+        #define MAX_LEAF_SIZE 56    // fingerprints and bitmap fill exactly one cache line
+    #else
+        #define MAX_LEAF_SIZE 64
+    #endif
     #define SIZE_ONE_BYTE_HASH 1
     #define SIZE_PMEM_POINTER 16
 #endif
@@ -66,17 +73,48 @@ enum Result { Insert, Update, Split, Abort, Delete, Remove, NotFound };
     #include <libpmemobj.h>
 
     #define PMEMOBJ_POOL_SIZE ((size_t)(1024 * 1024 * 11) * 1000)  /* 11 GB */
+    #define LEAF_GROUP_SIZE 64      // leaves allocated together in one persistent group
+    #define MAX_LOG_SLOTS 1024      // threads that can modify the tree at the same time
+    #define LOCK_DIR_BITS 16        // leaf groups per block of the lock directory, as a power of two
+    #define MAX_LEAF_GROUPS ((uint64_t)1 << (2 * LOCK_DIR_BITS))
+    #define SPARSE_INDEX_STRIDE 16  // leaves per entry of the sparse index used during a lazy rebuild
 
     POBJ_LAYOUT_BEGIN(FPtree);
     POBJ_LAYOUT_ROOT(FPtree, struct List);
     POBJ_LAYOUT_TOID(FPtree, struct LeafNode);
+    POBJ_LAYOUT_TOID(FPtree, struct LeafGroup);
+    POBJ_LAYOUT_TOID(FPtree, struct InnerSnapshot);
     POBJ_LAYOUT_END(FPtree);
 
-    POBJ_LAYOUT_BEGIN(Array);
-    POBJ_LAYOUT_TOID(Array, struct Log);
-    POBJ_LAYOUT_END(Array);
-
     inline PMEMobjpool *pop;
+
+    // Leaf locks live in DRAM, one padded lock per leaf and a chunk of them per leaf group,
+    // so locking never dirties a PMEM line and every lock is released after a restart
+    struct LeafLock
+    {
+        std::atomic<uint64_t> word{0};
+
+        // slots of the valid kvs of the leaf in key order, see LeafNode::sortedSlots
+        uint8_t sorted_slots[MAX_LEAF_SIZE];
+
+        // used only while the inner nodes are rebuilt in the background after a restart:
+        // low_key is the separator the leaf gets in the new index, set once and never changed
+        std::atomic<uint64_t> low_key{0};
+        std::atomic<uint8_t> lazy_state{0};
+    } __attribute__((aligned(64)));
+
+    enum LazyState : uint8_t { LOW_KEY_SET = 1, PREPARED = 2, INDEXED = 4 };
+
+    // two-level lock table: leaf_locks[group id >> LOCK_DIR_BITS] is a block of per-group lock chunks,
+    // allocated with the first group it covers, so the table grows with the pool
+    inline LeafLock** leaf_locks[(uint64_t)1 << LOCK_DIR_BITS];
+
+    // persistence cost, flushes are counted in cache lines
+    struct PersistStats
+    {
+        uint64_t flushes;
+        uint64_t fences;
+    };
 #endif
 
 static uint8_t getOneByteHash(uint64_t key);
@@ -97,6 +135,37 @@ struct LeafNodeStat
     uint64_t min_key;   // min key excluding key
 };
 
+// layout of the records handed to a scanRange visitor
+enum ScanOutput { ScanKV, ScanKeys, ScanValues, ScanColumns };
+
+// one leaf worth of records in key order, only the arrays of the requested layout are set
+struct ScanChunk
+{
+    uint64_t count;
+    const KV* kvs;              // ScanKV
+    const uint64_t* keys;       // ScanKeys, ScanColumns
+    const uint64_t* values;     // ScanValues, ScanColumns
+};
+
+// partial result of countRange, sumRange and minMaxRange
+struct RangeAggregate
+{
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t min_value = std::numeric_limits<uint64_t>::max();
+    uint64_t max_value = 0;
+    uint64_t max_key = 0;       // largest key aggregated
+    bool past_hi = false;       // a key beyond the range was seen, no later leaf can match
+};
+
+struct ScanOptions
+{
+    ScanOutput output = ScanKV;
+    // a record is emitted only if every filter set accepts it
+    std::function<bool(uint64_t)> key_filter;
+    std::function<bool(uint64_t)> value_filter;
+};
+
 // This Bitset class implements bitmap of size <= 64
 // The bitmap iterates from right to left - starting from least significant bit
 // off contains 0 on some significant bits when bitmap size < 64
@@ -178,6 +247,201 @@ class Bitset
 };
 
 
+/*
+    Slab arena for fixed-size volatile nodes. Nodes are cut from 2MB slabs and recycled through a
+    per-thread free list, so allocating inside a critical section is a pointer pop. Threads refill
+    from and spill to a shared list in batches; slabs are only returned when the process exits.
+    Build with ARENA_HUGE_PAGES to back slabs with huge pages.
+*/
+template <typename Node>
+class NodeArena
+{
+    static constexpr size_t SLAB_SIZE = 2 * 1024 * 1024;
+    static constexpr size_t BATCH = 64;
+
+    struct FreeNode
+    {
+        FreeNode* next;
+        FreeNode* next_batch;   // link between batches on the shared list
+    };
+
+    struct Cache
+    {
+        FreeNode* head = nullptr;
+        size_t count = 0;
+
+        ~Cache()
+        {
+            while (count)
+                spill(*this, std::min(count, BATCH));
+        }
+    };
+
+    static inline std::mutex lock;
+    static inline FreeNode* batches = nullptr;
+    static inline char* slab_cur = nullptr;
+    static inline char* slab_end = nullptr;
+    static inline thread_local Cache cache;
+
+    static char* allocSlab()
+    {
+        void* slab = MAP_FAILED;
+        #ifdef ARENA_HUGE_PAGES
+            slab = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        #endif
+        if (slab == MAP_FAILED)
+        {
+            slab = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED)
+                throw std::bad_alloc();
+            #ifdef ARENA_HUGE_PAGES
+                madvise(slab, SLAB_SIZE, MADV_HUGEPAGE);
+            #endif
+        }
+        return reinterpret_cast<char*> (slab);
+    }
+
+    // take a batch from the shared list, or carve a new one out of the current slab
+    static void refill(Cache& c)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (batches)
+        {
+            c.head = batches;
+            batches = batches->next_batch;
+            c.count = 0;
+            for (FreeNode* n = c.head; n; n = n->next)
+                c.count++;
+            return;
+        }
+        for (size_t i = 0; i < BATCH; i++)
+        {
+            if (slab_cur + sizeof(Node) > slab_end)
+            {
+                slab_cur = allocSlab();
+                slab_end = slab_cur + SLAB_SIZE;
+            }
+            FreeNode* n = reinterpret_cast<FreeNode*> (slab_cur);
+            slab_cur += sizeof(Node);
+            n->next = c.head;
+            c.head = n;
+            c.count++;
+        }
+    }
+
+    // hand the first n nodes of the cache over to the shared list
+    static void spill(Cache& c, size_t n)
+    {
+        FreeNode* first = c.head, *last = c.head;
+        for (size_t i = 1; i < n; i++)
+            last = last->next;
+        c.head = last->next;
+        c.count -= n;
+        last->next = nullptr;
+
+        std::lock_guard<std::mutex> guard(lock);
+        first->next_batch = batches;
+        batches = first;
+    }
+
+ public:
+    static void* allocate()
+    {
+        Cache& c = cache;
+        if (!c.head)
+            refill(c);
+        FreeNode* n = c.head;
+        c.head = n->next;
+        c.count--;
+        return n;
+    }
+
+    static void deallocate(void* p)
+    {
+        Cache& c = cache;
+        FreeNode* n = reinterpret_cast<FreeNode*> (p);
+        n->next = c.head;
+        c.head = n;
+        if (++c.count >= 2 * BATCH)
+            spill(c, BATCH);
+    }
+};
+
+
+/*
+    Epoch-based reclamation. Every tree operation runs inside an EpochGuard, which publishes the
+    global epoch the thread entered in. Unlinked nodes are retired with the current epoch and freed
+    once the global epoch is two ahead, which needs every thread inside a guard to have entered a
+    later epoch, so a traversal never touches freed memory.
+*/
+class Epoch
+{
+ public:
+    typedef void (*Deleter)(void*);
+
+    // guards nest, only the outermost one publishes and clears the thread's epoch
+    static void enter();
+
+    // leaving the outermost guard also reclaims what this thread retired, every RECLAIM_BATCH nodes
+    static void exit();
+
+    // call instead of freeing a node that is no longer reachable from the tree
+    static void retire(void* node, Deleter deleter);
+
+    // free every retired node at once, no thread may be inside a guard
+    static void drain();
+
+ private:
+    static constexpr size_t RECLAIM_BATCH = 64;
+
+    struct Retired
+    {
+        void* node;
+        Deleter deleter;
+        uint64_t epoch;
+    };
+
+    // one per thread, records of exited threads are reused together with their pending nodes
+    struct alignas(64) Record
+    {
+        std::atomic<uint64_t> epoch{0};     // 0 outside of guards
+        std::atomic<bool> in_use{true};
+        uint64_t depth = 0;
+        size_t retired_since_reclaim = 0;
+        tbb::spin_mutex limbo_lock;
+        std::vector<Retired> limbo;         // in retire order, so epochs never decrease
+        Record* next = nullptr;
+    };
+
+    struct Handle
+    {
+        Record* record = nullptr;
+        ~Handle();
+    };
+
+    static std::atomic<uint64_t> global_epoch;
+    static std::atomic<Record*> records;
+    static thread_local Handle handle;
+
+    static Record* self();
+
+    // bump the global epoch if every thread inside a guard has entered the current one
+    static void tryAdvance();
+
+    // free the nodes of record retired at least two epochs ago, or all of them
+    static void reclaim(Record* record, bool all);
+};
+
+class EpochGuard
+{
+ public:
+    EpochGuard() { Epoch::enter(); }
+    ~EpochGuard() { Epoch::exit(); }
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+
 /*******************************************************
                   Define node struture 
 ********************************************************/
@@ -201,6 +465,11 @@ struct InnerNode : BaseNode
     uint64_t keys[MAX_INNER_SIZE];
     BaseNode* p_children[MAX_INNER_SIZE + 1];
 
+    #ifdef OLC
+        // optimistic lock: bit 0 obsolete, bit 1 write locked, each write lock/unlock adds 2
+        std::atomic<uint64_t> version;
+    #endif
+
     friend class FPtree;
 
  public:
@@ -212,6 +481,9 @@ struct InnerNode : BaseNode
     // for using mempool only where constructor is not called 
     void init(uint64_t key, BaseNode* left, BaseNode* right);
 
+    static void* operator new(size_t) { return NodeArena<InnerNode>::allocate(); }
+    static void operator delete(void* ptr) { NodeArena<InnerNode>::deallocate(ptr); }
+
     // return index of child in p_children when searching key in this innernode
     uint64_t findChildIndex(uint64_t key);
 
@@ -220,11 +492,52 @@ struct InnerNode : BaseNode
 
     // add key at index pos, default add child to the right
     void addKey(uint64_t index, uint64_t key, BaseNode* child, bool add_child_right);
+
+    // add n sorted keys at index pos, each with its child to the right, there must be room for them
+    void addKeys(uint64_t index, const uint64_t* keys, BaseNode* const* children, uint64_t n);
+
+    // remove children first..last and as many keys, the ones left of them (right of them if first is 0),
+    // at least one child must remain
+    void removeChildren(uint64_t first, uint64_t last);
+
+    #ifdef OLC
+        // wait until node is not write locked and return its version in v, false if node is obsolete
+        bool readLock(uint64_t& v)
+        {
+            while ((v = this->version.load(std::memory_order_acquire)) & 2)
+                _mm_pause();
+            return !(v & 1);
+        }
+
+        // return true if node has not been write locked since readLock returned v
+        bool validate(uint64_t v)
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return this->version.load(std::memory_order_relaxed) == v;
+        }
+
+        void writeLock()
+        {
+            uint64_t v;
+            while (true)
+            {
+                v = this->version.load(std::memory_order_relaxed);
+                if (!(v & 2) && this->version.compare_exchange_weak(v, v + 2))
+                    return;
+                _mm_pause();
+            }
+        }
+
+        void writeUnlock() { this->version.fetch_add(2, std::memory_order_release); }
+
+        void writeUnlockObsolete() { this->version.fetch_add(3, std::memory_order_release); }
+    #endif
 } __attribute__((aligned(64)));
 
 
 struct LeafNode : BaseNode
 {
+    // the leaf header: with MAX_LEAF_SIZE <= 56 the bitmap shares the cache line of the fingerprints
     __attribute__((aligned(64))) uint8_t fingerprints[MAX_LEAF_SIZE];
     Bitset bitmap;
 
@@ -236,7 +549,15 @@ struct LeafNode : BaseNode
         LeafNode* p_next;
     #endif
 
-    std::atomic<uint64_t> lock;
+    #ifdef PMEM
+        uint64_t lock_id;       // index of the lock in leaf_locks, fixed when the leaf group is created
+    #else
+        std::atomic<uint64_t> lock;
+    #endif
+
+    #ifndef PMEM
+        uint8_t sorted_slots[MAX_LEAF_SIZE];
+    #endif
 
     friend class FPtree;
 
@@ -245,6 +566,9 @@ struct LeafNode : BaseNode
         LeafNode();
         LeafNode(const LeafNode& leaf);
         LeafNode& operator=(const LeafNode& leaf);
+
+        static void* operator new(size_t) { return NodeArena<LeafNode>::allocate(); }
+        static void operator delete(void* ptr) { NodeArena<LeafNode>::deallocate(ptr); }
     #endif
 
     inline bool isFull() { return this->bitmap.is_full(); }
@@ -254,18 +578,82 @@ struct LeafNode : BaseNode
     // find index of kv that has kv.key = key, return MAX_LEAF_SIZE if key not found
     uint64_t findKVIndex(uint64_t key);
 
+    // same as above, but only look at candidate slots returned by matchFingerprints
+    uint64_t findKVIndex(uint64_t key, uint64_t candidates);
+
+    // return mask of valid slots whose fingerprint matches the hash of key
+    uint64_t matchFingerprints(uint64_t key);
+
     // return min key in leaf
     uint64_t minKey();
 
+    // rebuild sortedSlots() from bitmap and kv_pairs
+    void sortSlots();
+
+    // recompute fingerprints of valid slots, they are persisted together with the bitmap and may be torn
+    void rebuildFingerprints();
+
+    // add slot into sortedSlots(), must be called before slot is set in bitmap
+    void addSortedSlot(uint64_t slot);
+
+    // remove slot from sortedSlots(), must be called before slot is reset in bitmap
+    void removeSortedSlot(uint64_t slot);
+
+    // remove all slots in mask from sortedSlots(), must be called before they are reset in bitmap
+    void removeSortedSlots(uint64_t mask);
+
+    // new_slot holds the same key as old_slot (out-of-place update)
+    void replaceSortedSlot(uint64_t old_slot, uint64_t new_slot);
+
+    // return position in sortedSlots() of the first kv with kv.key >= key
+    uint64_t findSortedPos(uint64_t key);
+
+    #ifdef PMEM
+        inline LeafLock& lockEntry()
+        {
+            uint64_t group = this->lock_id / LEAF_GROUP_SIZE;
+            return leaf_locks[group >> LOCK_DIR_BITS][group & ((1 << LOCK_DIR_BITS) - 1)][this->lock_id % LEAF_GROUP_SIZE];
+        }
+    #endif
+
+    // slots of valid kvs in key order, [0..bitmap.count()) is valid. Only modified under leaf lock and
+    // volatile: with PMEM they sit in the DRAM lock entry and sortSlots() rebuilds them after a restart
+    inline uint8_t* sortedSlots()
+    {
+        #ifdef PMEM
+            return lockEntry().sorted_slots;
+        #else
+            return this->sorted_slots;
+        #endif
+    }
+
+    // lock is also a version: odd while locked, every Lock and Unlock bumps it,
+    // so optimistic readers can tell whether the leaf changed under them
+    inline std::atomic<uint64_t>& lockWord()
+    {
+        #ifdef PMEM
+            return lockEntry().word;
+        #else
+            return this->lock;
+        #endif
+    }
     bool Lock()
     {
-        uint64_t expected = 0;
-        return std::atomic_compare_exchange_strong(&lock, &expected, 1);
+        uint64_t expected = this->lockWord().load(std::memory_order_relaxed);
+        return !(expected & 1) && this->lockWord().compare_exchange_strong(expected, expected + 1);
     }
     void Unlock()
     {
-        this->lock = 0;
+        this->lockWord().store((this->lockWord().load(std::memory_order_relaxed) | 1) + 1, std::memory_order_release);
     }
+    // a recycled leaf is reinitialized with a version above its old one rather than 0, so optimistic
+    // readers still holding a version of its previous contents fail validation
+    void resetVersion(bool locked)
+    {
+        this->lockWord().store(((this->lockWord().load(std::memory_order_relaxed) | 1) + 1) + locked, 
+                               std::memory_order_release);
+    }
+    inline bool isLocked() { return this->lockWord().load(std::memory_order_acquire) & 1; }
 
     void getStat(uint64_t key, LeafNodeStat& lstat);
 } __attribute__((aligned(64)));
@@ -280,6 +668,7 @@ struct LeafNode : BaseNode
         __attribute__((aligned(64))) uint8_t fingerprints[MAX_LEAF_SIZE];
         KV kv_pairs[MAX_LEAF_SIZE];
         uint64_t lock;
+        uint8_t sorted_slots[MAX_LEAF_SIZE];
 
         argLeafNode(LeafNode* leaf)
         {
@@ -287,6 +676,7 @@ struct LeafNode : BaseNode
             size = sizeof(struct LeafNode);
             memcpy(fingerprints, leaf->fingerprints, sizeof(leaf->fingerprints));
             memcpy(kv_pairs, leaf->kv_pairs, sizeof(leaf->kv_pairs));
+            memcpy(sorted_slots, leaf->sortedSlots(), sizeof(sorted_slots));
             bitmap = leaf->bitmap;
             lock = 1;
         }
@@ -298,15 +688,22 @@ struct LeafNode : BaseNode
             kv_pairs[0] = kv;
             fingerprints[0] = getOneByteHash(kv.key);
             bitmap.set(0);
+            sorted_slots[0] = 0;
             lock = 0;
         }
     };
 
     static int constructLeafNode(PMEMobjpool *pop, void *ptr, void *arg);
 
-    struct List
+    /*
+        Leaves are carved out of groups chained from List::groups; groups are never freed. A leaf
+        is in use iff it is reachable from the leaf list, free leaves are tracked in DRAM only.
+    */
+    struct LeafGroup
     {
-        TOID(struct LeafNode) head;
+        TOID(struct LeafGroup) next;
+        uint64_t id;            // groups are numbered in allocation order, the list head has the largest id
+        LeafNode leaves[LEAF_GROUP_SIZE];
     };
 
 /*
@@ -318,39 +715,58 @@ struct LeafNode : BaseNode
         TOID(struct LeafNode) PLeaf;
     };
 
-    static const uint64_t sizeLogArray = 128;
-
-    static boost::lockfree::queue<Log*> splitLogQueue = boost::lockfree::queue<Log*>(sizeLogArray);
-    static boost::lockfree::queue<Log*> deleteLogQueue = boost::lockfree::queue<Log*>(sizeLogArray);
-#endif
-
-
-struct Stack //TODO: Get rid of Stack
-{
- public:
-    static const uint64_t kMaxNodes = 32;
-    InnerNode* innerNodes[kMaxNodes];
-    uint64_t num_nodes;
-
-    Stack() : num_nodes(0) {}
-    ~Stack() { num_nodes = 0; }
-
-    inline void push(InnerNode* node)
+    // deleteRange: the boundary leaves trimmed to bitmaps and the leaves from PFirst up to PAfter unlinked
+    // after PLeaf (the list head if null). Written before any of it, replayed forward while valid is set
+    struct RangeLog
     {
-        assert(num_nodes < kMaxNodes && "Error: exceed max stack size");
-        this->innerNodes[num_nodes++] = node;
-    }
+        TOID(struct LeafNode) PLeaf;
+        TOID(struct LeafNode) PFirst;
+        TOID(struct LeafNode) PAfter;
+        TOID(struct LeafNode) PTrimmed[2];
+        uint64_t bitmaps[2];
+        uint64_t valid;
+    };
 
-    InnerNode* pop() { return num_nodes == 0 ? nullptr : this->innerNodes[--num_nodes]; }
+    // micro-logs owned by one worker thread, cache line aligned so workers never share a line
+    struct LogSlot
+    {
+        Log split;
+        Log del;
+        RangeLog range;
+    } __attribute__((aligned(64)));
+
+    /*
+        Inner nodes written breadth first on a clean shutdown. Children of a node are indices into
+        nodes, or pool offsets of leaves when leaf_children is set. The snapshot is only valid while
+        epoch matches List::epoch, and every open bumps List::epoch.
+    */
+    struct SnapshotNode
+    {
+        uint64_t leaf_children;
+        uint64_t nKey;
+        uint64_t keys[MAX_INNER_SIZE];
+        uint64_t children[MAX_INNER_SIZE + 1];
+    };
 
-    inline bool isEmpty() { return num_nodes == 0; }
+    struct InnerSnapshot
+    {
+        uint64_t epoch;
+        uint64_t root_leaf;     // pool offset of the root when it is a leaf, 0 otherwise
+        uint64_t num_nodes;
+        SnapshotNode nodes[];
+    };
 
-    inline InnerNode* top() { return num_nodes == 0 ? nullptr : this->innerNodes[num_nodes - 1]; }
+    struct List
+    {
+        TOID(struct LeafNode) head;
+        TOID(struct LeafGroup) groups;
+        TOID(struct InnerSnapshot) snapshot;
+        uint64_t epoch;
+        LogSlot logs[MAX_LOG_SLOTS];
+    };
+#endif
 
-    inline void clear() { num_nodes = 0; }
-};
 
-static thread_local Stack stack_innerNodes;
 static thread_local InnerNode* inners[32];
 static thread_local short ppos[32];
 
@@ -359,7 +775,30 @@ struct FPtree
     BaseNode *root;
     tbb::speculative_spin_rw_mutex speculative_lock;
 
-    InnerNode* right_most_innnerNode; // for bulkload
+    #ifdef OLC
+        // serializes structure modifications, readers and leaf writers never take it
+        std::mutex smo_lock;
+    #endif
+
+    #ifdef PMEM
+        // Lazy rebuild: while rebuilding is set, root is not valid yet. Leaves are found through every
+        // SPARSE_INDEX_STRIDE-th leaf in sparse_index and then the leaf list, scans follow the list.
+        // Leaf splits go on and leave their separators in pending_splits for the rebuilder to post,
+        // other structure modifications wait in awaitIndex until the rebuilder publishes root.
+        struct SparseEntry
+        {
+            uint64_t key;
+            LeafNode* leaf;
+        };
+        std::atomic<bool> rebuilding{false};
+        std::unique_ptr<SparseEntry[]> sparse_index;
+        std::atomic<size_t> sparse_size{0};
+        uint64_t rebuild_groups = 0;
+        std::vector<std::pair<uint64_t, LeafNode*>> pending_splits;     // guarded by rebuild_lock
+        std::mutex rebuild_lock;
+        std::condition_variable rebuild_done;
+        std::thread rebuilder;
+    #endif
 
  public:
     FPtree();
@@ -372,35 +811,134 @@ struct FPtree
     // return flse if kv.key not found, otherwise set kv.value to value associated with kv.key
     uint64_t find(uint64_t key);
 
+    // look up n keys with one traversal per distinct leaf, out[i] is set as find(keys[i]) would return
+    void findBatch(const uint64_t* keys, size_t n, uint64_t* out);
+
+    // look up n unsorted keys, interleaving up to group_size traversals to overlap their cache misses
+    void findInterleaved(const uint64_t* keys, size_t n, uint64_t* out, size_t group_size = 8);
+
     // return false if kv.key not found, otherwise update value associated with key
     bool update(struct KV kv);
 
-    // return false if key already exists, otherwise insert kv
+    // return false if key already exists or the pool is out of leaves, otherwise insert kv
     bool insert(struct KV kv);
 
     // delete key from tree
     bool deleteKey(uint64_t key);
 
-    // TODO: fix/optimize iterator based scan methods
-    // initialize scan by finding the first kv with kv.key >= key
-    void scanInitialize(uint64_t key);
+    // Read-modify-write operations: one traversal and one leaf lock, an existing value is overwritten
+    // in place with a single failure-atomic 8-byte persist.
+    // insert kv, or set the value of kv.key if it exists; return true if kv was inserted
+    bool upsert(struct KV kv);
+
+    // add delta to the value of key and set old_value to its old value, insert (key, delta) and set old_value
+    // to 0 if key not found; found, if given, tells the two cases apart since a stored value may be 0.
+    // Return false if key not found and the pool is out of leaves
+    bool fetchAdd(uint64_t key, uint64_t delta, uint64_t& old_value, bool* found = nullptr);
+
+    // set the value of key to desired if it is expected, return false if key not found or value differs
+    bool compareAndSwap(uint64_t key, uint64_t expected, uint64_t desired);
 
-    KV scanNext();
+    // Batched versions of insert, update and deleteKey: records are sorted and applied leaf by leaf,
+    // taking each leaf lock once and persisting each leaf once. Return number of records applied.
+    uint64_t insertBatch(const KV* kvs, size_t n);
 
-    bool scanComplete();
+    uint64_t updateBatch(const KV* kvs, size_t n);
+
+    uint64_t deleteBatch(const uint64_t* keys, size_t n);
+
+    // Build the tree from n records sorted by key, the tree must be empty and not in use. Leaves are written
+    // one after the other, filled to load_factor, by num_threads threads (0 for one per core) over key
+    // partitions. Of equal keys the first is kept. Return number of records loaded, 0 if kvs is not sorted
+    // or the pool ran out of leaves.
+    uint64_t bulkBuild(const KV* kvs, size_t n, float load_factor = 1, unsigned num_threads = 0);
+
+    // Insert n records sorted by key into the tree, skipping keys that exist. The leaf list is walked
+    // along with the records, every leaf splits at most once, and the separators of its new leaves are
+    // posted to the inner nodes together right after. Return number of records inserted, 0 if kvs is not sorted.
+    uint64_t mergeSorted(const KV* kvs, size_t n);
+
+    // Delete all keys lo <= key <= hi and return number deleted. The boundary leaves are trimmed and all
+    // leaves in between are unlinked from the leaf list in one step under a single delete log.
+    uint64_t deleteRange(uint64_t lo, uint64_t hi);
 
     uint64_t rangeScan(uint64_t key, uint64_t scan_size, char* result);
 
+    // Call visitor with the records lo <= key <= hi in key order, one chunk per leaf, until limit records
+    // are emitted or visitor returns false. Chunks live on the stack and are valid only during the call.
+    // Return number of records emitted.
+    uint64_t scanRange(uint64_t lo, uint64_t hi, uint64_t limit, const std::function<bool(const ScanChunk&)>& visitor,
+                       const ScanOptions& options = ScanOptions());
+
+    // Aggregates over the values of records lo <= key <= hi, reduced inside the leaves without copying records
+    uint64_t countRange(uint64_t lo, uint64_t hi);
+
+    // sum wraps around modulo 2^64
+    uint64_t sumRange(uint64_t lo, uint64_t hi);
+
+    // return false if there is no record in range, otherwise set min_value and max_value
+    bool minMaxRange(uint64_t lo, uint64_t hi, uint64_t& min_value, uint64_t& max_value);
+
+    // Iterator over kvs in key order. A cursor owns its buffer and refills it one leaf at a time with
+    // the same validated copy as rangeScan, holding no lock and no leaf between calls, so any number
+    // of cursors can run concurrently with each other and with writers. A cursor itself is not thread-safe.
+    class Cursor
+    {
+     public:
+        // position cursor at the first kv with kv.key >= key
+        Cursor(FPtree& tree, uint64_t key = 0);
+
+        void seek(uint64_t key);
+
+        // return false if there is no more kv, otherwise set kv to the next kv
+        bool next(KV& kv);
+
+        // copy up to n next kvs into out, return number copied (less than n only at the end)
+        uint64_t nextBatch(KV* out, uint64_t n);
+
+     private:
+        FPtree* tree;
+        KV buffer[MAX_LEAF_SIZE];
+        uint64_t size;          // kvs in buffer
+        uint64_t pos;           // next kv to return from buffer
+        uint64_t next_key;      // refill starts at this key
+        bool exhausted;         // the largest possible key has been copied
+
+        bool refill();
+
+        // move next_key past the last of n kvs just copied
+        void advance(const KV* copied, uint64_t n);
+    };
+
     #ifdef PMEM
-        bool bulkLoad(float load_factor);
+        // rebuild the volatile part of the tree from the leaf list: leaves are prepared and inner levels are
+        // built bottom-up with num_threads threads (0 for one per core), nodes filled to load_factor
+        bool bulkLoad(float load_factor = 1, unsigned num_threads = 0);
 
         void recoverSplit(Log* uLog);
 
         void recoverDelete(Log* uLog);
 
+        void recoverDeleteRange(RangeLog* uLog);
+
         void recover();
 
-        void pmemInit(const char* path_ptr, long long pool_size);
+        // write the inner nodes to the pool on a clean shutdown, and map them back on the next open
+        void saveSnapshot();
+
+        bool loadSnapshot();
+
+        // with lazy_rebuild, return once the logs are replayed and rebuild the inner nodes in the background.
+        // The leaf locks of a pool used before are dropped, no other thread may still hold leaves of it
+        void pmemInit(const char* path_ptr, long long pool_size, bool lazy_rebuild = false);
+
+        // block until the inner nodes are complete
+        void awaitIndex();
+
+        // totals of all threads since start or the last reset, divide by the ops run for the cost per op
+        static PersistStats persistStats();
+
+        static void resetPersistStats();
 
         void showList();
     #endif
@@ -409,21 +947,130 @@ struct FPtree
     // return leaf that may contain key, does not push inner nodes
     LeafNode* findLeaf(uint64_t key);
 
-    // return leaf that may contain key, push all innernodes on traversal path into stack
-    LeafNode* findLeafAndPushInnerNodes(uint64_t key);
+    // AMAC lookup engine behind find and findInterleaved, the caller holds an EpochGuard
+    void lookupInterleaved(const uint64_t* keys, size_t n, uint64_t* out, size_t group_size);
+
+    // return leaf that may contain key, bounded is false if leaf is the right most leaf
+    // otherwise all keys in leaf are < upper
+    LeafNode* findLeafAndUpperBound(uint64_t key, uint64_t& upper, bool& bounded);
+
+    // return locked leaf that may contain key (nullptr if tree is empty), upper and bounded as above
+    LeafNode* lockLeaf(uint64_t key, uint64_t& upper, bool& bounded);
+
+    // return locked leaf that may contain kv.key, or nullptr after making kv the first kv of an empty tree,
+    // inserted is false then if no leaf could be allocated for it
+    LeafNode* lockLeafOrInsertRoot(struct KV kv, bool& inserted);
+
+    #ifdef OLC
+        // optimistic traversal without any lock: return leaf that may contain key with its lock version.
+        // Restart on concurrent modifications. The caller holds an EpochGuard, and anything read from
+        // leaf is valid only if validateLeaf succeeds afterwards.
+        LeafNode* findLeafOptimistic(uint64_t key, uint64_t& leaf_version, uint64_t* upper = nullptr, bool* bounded = nullptr);
+
+        bool validateLeaf(LeafNode* leaf, uint64_t leaf_version);
+    #endif
+
+    #ifdef PMEM
+        // lazy rebuild: return locked leaf that may contain key, or nullptr once root is published
+        LeafNode* lockLeafLazy(uint64_t key, uint64_t& upper, bool& bounded);
+
+        // walk the leaf list once, publishing sparse index entries as it goes, then build and publish root
+        void rebuildIndex();
+
+        // during a lazy rebuild, queue the separator of a leaf split off a locked leaf for the rebuilder
+        // and return true. Also true if the rebuilder has indexed leaf already, false if it must be posted
+        bool deferSplit(uint64_t splitKey, LeafNode* leaf);
+
+        // deferSplit each of splits, the ones taken care of are dropped and their new leaves unlocked
+        void deferSplits(std::vector<std::pair<uint64_t, LeafNode*>>& splits);
+    #endif
 
-    uint64_t findSplitKey(LeafNode* leaf);
+    // exclusive section for structure modifications: speculative_lock as writer with HTM,
+    // smo_lock with OLC, where inner nodes are write locked by lockInner until releaseSMO
+    void acquireSMO(tbb::speculative_spin_rw_mutex::scoped_lock& lock);
 
-    uint64_t splitLeaf(LeafNode* leaf);
+    void releaseSMO(tbb::speculative_spin_rw_mutex::scoped_lock& lock);
 
-    void updateParents(uint64_t splitKey, InnerNode* parent, BaseNode* leaf);
+    // call before modifying an inner node inside an SMO
+    void lockInner(InnerNode* node);
 
-    void splitLeafAndUpdateInnerParents(LeafNode* reachedLeafNode, Result decision, struct KV kv, 
+    // call instead of deleting an inner node inside an SMO, the node is retired to Epoch by releaseSMO
+    void freeInner(InnerNode* node);
+
+
+    // move the upper half of full leaf to a new leaf linked after it, return the new leaf with its min key
+    // in splitKey, or nullptr with leaf unchanged if no leaf could be allocated
+    LeafNode* splitLeaf(LeafNode* leaf, uint64_t& splitKey);
+
+    // add splitKey and newLeafNode (split from leaf) into inner nodes, caller is in an SMO
+    void updateInnerParents(LeafNode* leaf, LeafNode* newLeafNode, uint64_t splitKey);
+
+    // add the separators of leaves split from leaf, in key order, into its parent in one step. A full
+    // parent is split once into as many nodes as needed and their separators go up the same way.
+    // Caller is in an SMO
+    void updateInnerParents(LeafNode* leaf, const std::vector<std::pair<uint64_t, LeafNode*>>& splits);
+
+    // return false if the split of a full leaf failed, kv is not written then
+    bool splitLeafAndUpdateInnerParents(LeafNode* reachedLeafNode, Result decision, struct KV kv, 
                                                                 bool updateFunc, uint64_t prevPos);
 
+    // copy up to scan_size kvs with kv.key >= key into records in key order, return number copied.
+    // If one_leaf is set, stop at the end of the first leaf that yields a kv.
+    uint64_t copyRange(uint64_t key, KV* records, uint64_t scan_size, bool one_leaf);
+
+    // Walk leaves in key order from the one that may contain key without taking any lock.
+    // read(leaf, start, next) reads kvs with kv.key >= start and sets next, returning false if leaf looked
+    // inconsistent. A read is redone until the leaf version validates, then commit() is called, which
+    // returns false to stop and must move key past the leaf so that a new traversal resumes after it.
+    template <typename Read, typename Commit>
+    void walkLeaves(uint64_t& key, Read&& read, Commit&& commit);
+
+    // Copy leaves from the one that may contain key into records, skipping kvs with kv.key < key, and call
+    // emit(first, n) with the n records of each validated leaf; emit returns false to stop.
+    // records fill up to capacity, or each leaf is copied to the start of records if chunked.
+    template <typename Emit>
+    uint64_t copyLeaves(uint64_t key, KV* records, uint64_t capacity, bool chunked, Emit&& emit);
+
+    // reduce the records lo <= key <= hi leaf by leaf with walkLeaves
+    void aggregateRange(uint64_t lo, uint64_t hi, RangeAggregate& total);
+
+    // build inner levels bottom-up over nodes of one level in key order with their min keys, return the root
+    BaseNode* buildInnerLevels(std::vector<BaseNode*> level, std::vector<uint64_t> min_keys, 
+                               float load_factor, unsigned num_threads);
+
+    // shared by insertBatch and updateBatch
+    uint64_t modifyBatch(const KV* kvs, size_t n, bool updateFunc);
+
+    // apply sorted kvs that all fall into locked leaf, splitting it as often as needed. Stop early if a
+    // split runs out of leaves, return number of records applied
+    uint64_t applyLeafBatch(LeafNode* leaf, const KV* kvs, size_t n, bool updateFunc);
+
+    // insert sorted new kvs that all fall into locked leaf, splitting it at most once into as many leaves
+    // as needed. The new leaves are appended to splits with their separators, locked and not yet posted.
+    // Return number of kvs inserted, 0 with leaf unchanged if the pool is out of leaves
+    uint64_t mergeLeaf(LeafNode* leaf, const KV* kvs, size_t n, std::vector<std::pair<uint64_t, LeafNode*>>& splits);
+
+    // lock the leaf after locked leaf, with upper and bounded as for lockLeaf. Return nullptr if that leaf
+    // is busy, if there is none or during a lazy rebuild
+    LeafNode* lockNextLeaf(LeafNode* leaf, uint64_t& upper, bool& bounded);
+
     // merge parent with sibling, may incur further merges. Remove key from indexNode after
     void removeLeafAndMergeInnerNodes(short i, short indexNode_level);
 
+    // inners[i] is left without a key: borrow one from or merge it with a sibling, up to the root
+    void mergeInnerNodes(short i);
+
+    // remove the leaves first..last, consecutive in the list, from the inner nodes in one bottom-up pass,
+    // then fix the nodes left without a key on the paths to key_before and key_after; caller is in an SMO
+    void removeLeafRun(LeafNode* first, LeafNode* last, uint64_t key_before, uint64_t key_after);
+
+    // freeInner node and every inner node below it
+    void freeInnerTree(InnerNode* node);
+
+    // set the separator that bounds the leaf holding key from below, if there is one, to new_key;
+    // caller is in an SMO
+    void resetLowSeparator(uint64_t key, uint64_t new_key);
+
     // try transfer a key from sender to receiver, sender and receiver should be immediate siblings
     // If receiver & sender are inner nodes, will assume the only child in receiver is at index 0
     // return false if cannot borrow key from sender
@@ -435,13 +1082,5 @@ struct FPtree
 
     LeafNode* maxLeaf(BaseNode* node);
 
-    void sortKV();
-
-    uint64_t size_volatile_kv;
-    KV volatile_current_kv[MAX_LEAF_SIZE];
-
-    LeafNode* current_leaf;
-    uint64_t bitmap_idx;
-
     friend class Inspector;
 };
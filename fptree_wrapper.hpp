@@ -27,6 +27,20 @@ public:
     virtual bool remove(const char* key, size_t key_sz) override;
     virtual int scan(const char* key, size_t key_sz, int scan_sz, char*& values_out) override;
 
+    // keys holds num_keys keys of key_sz bytes, values_out receives one value per key
+    // return number of keys found
+    int findBatch(const char* keys, size_t key_sz, size_t num_keys, char* values_out);
+
+    // insert key, or overwrite its value if it exists; return true if key was inserted
+    bool upsert(const char* key, size_t key_sz, const char* value, size_t value_sz);
+
+    // add delta to the value of key (inserting delta if key is not found), old value or 0 goes to value_out
+    // return false if key was not found and could not be inserted
+    bool fetchAdd(const char* key, size_t key_sz, uint64_t delta, char* value_out);
+
+    // set the value of key to desired if it is currently expected
+    bool compareAndSwap(const char* key, size_t key_sz, const char* expected, const char* desired, size_t value_sz);
+
 private:
     FPtree tree_;
 };
@@ -64,6 +78,20 @@ bool fptree_wrapper::find(const char* key, size_t key_sz, char* value_out)
     return true;
 }
 
+int fptree_wrapper::findBatch(const char* keys, size_t key_sz, size_t num_keys, char* values_out)
+{
+    // For now only support 8 bytes key and value (uint64_t)
+    uint64_t* values = reinterpret_cast<uint64_t*>(values_out);
+    tree_.findBatch(reinterpret_cast<const uint64_t*>(keys), num_keys, values);
+    int found = 0;
+    for (size_t i = 0; i < num_keys; i++)
+        found += values[i] != 0;
+#ifdef DEBUG_MSG
+    printf("%d of %zu keys found\n", found, num_keys);
+#endif
+    return found;
+}
+
 
 bool fptree_wrapper::insert(const char* key, size_t key_sz, const char* value, size_t value_sz)
 {
@@ -91,6 +119,39 @@ bool fptree_wrapper::update(const char* key, size_t key_sz, const char* value, s
     return true;
 }
 
+bool fptree_wrapper::upsert(const char* key, size_t key_sz, const char* value, size_t value_sz)
+{
+    KV kv = KV(*reinterpret_cast<uint64_t*>(const_cast<char*>(key)), *reinterpret_cast<uint64_t*>(const_cast<char*>(value)));
+    return tree_.upsert(kv);
+}
+
+bool fptree_wrapper::fetchAdd(const char* key, size_t key_sz, uint64_t delta, char* value_out)
+{
+    uint64_t old_value;
+    if (!tree_.fetchAdd(*reinterpret_cast<uint64_t*>(const_cast<char*>(key)), delta, old_value))
+    {
+#ifdef DEBUG_MSG
+        printf("Fetch and add failed\n");
+#endif
+        return false;
+    }
+    memcpy(value_out, &old_value, sizeof(old_value));
+    return true;
+}
+
+bool fptree_wrapper::compareAndSwap(const char* key, size_t key_sz, const char* expected, const char* desired, size_t value_sz)
+{
+    if (!tree_.compareAndSwap(*reinterpret_cast<uint64_t*>(const_cast<char*>(key)), 
+                              *reinterpret_cast<const uint64_t*>(expected), *reinterpret_cast<const uint64_t*>(desired)))
+    {
+#ifdef DEBUG_MSG
+        printf("Compare and swap failed\n");
+#endif
+        return false;
+    }
+    return true;
+}
+
 bool fptree_wrapper::remove(const char* key, size_t key_sz)
 {
     if (!tree_.deleteKey(*reinterpret_cast<uint64_t*>(const_cast<char*>(key))))
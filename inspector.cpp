@@ -8,8 +8,11 @@
 #include <utility>
 #include <stdlib.h>
 #include <chrono>
+#include <random>
+#include <new>
 
 #include "fptree.h"
+#include "fptree_wrapper.hpp"
 
 
 #define NUM_RECORDS 10000000		// Number of records to start with
@@ -27,6 +30,38 @@
 
 #define BULK_LOAD 0				// Create another tree using the test_pool, check integrity
 
+#define CHECK_BATCH 1			// Insert NUM_BATCH_RECORDS records with insertBatch, delete half with deleteBatch
+#define NUM_BATCH_RECORDS 1000000
+
+#define CHECK_FIND_BATCH 1		// findBatch and findInterleaved against find on a shuffled mix of present and absent keys
+
+#define CHECK_SCAN 1			// Compare a filtered scanRange against the records expected
+
+#define CHECK_CURSOR 1			// Cursor seek, next and nextBatch against the records expected
+
+#define CHECK_AGGREGATE 1		// countRange, sumRange and minMaxRange against the records expected
+
+#define CHECK_UPDATE_IN_PLACE 1	// Update every key of a full leaf, no leaf may split
+
+#define CHECK_PERSIST_STATS 1	// Flushes and fences counted for one find, insert, update and delete
+
+#define CHECK_RMW 1				// upsert, fetchAdd and compareAndSwap on existing and missing keys, then through fptree_wrapper
+
+#define CHECK_DELETE_RANGE 1	// Delete a range spanning many leaves and one inside a leaf
+
+#define CHECK_MERGE 1			// mergeSorted runs that split leaves several ways, then a crash in such a split
+#define MERGE_STRIDE 1000		// a run after every MERGE_STRIDE-th key
+#define MERGE_RUN_SIZE (3 * MAX_LEAF_SIZE)
+
+#define CHECK_REOPEN 1			// Close the tree cleanly and open it again from the snapshot
+
+#define CHECK_LAZY_REOPEN 1		// Crash, reopen with lazy rebuild and run batches during the rebuild
+
+#define CHECK_BULK_BUILD 1		// Empty the tree and bulkBuild it again at several load factors
+
+#define CHECK_POOL_FULL 1		// bulkBuild more records than fit into a small pool, then a quarter of them
+#define SMALL_POOL_SIZE (8 * 1024 * 1024)
+
 static thread_local std::unordered_map<uint64_t, uint64_t> count_;
 
 struct Queue 
@@ -89,9 +124,14 @@ public:
     void KVPresenceCheck(FPtree& tree, std::vector<uint64_t>& keys, std::vector<uint64_t>& values);
     void InnerNodeOrderCheck(InnerNode* node, std::vector<uint64_t>& keys);
     void SubtreeOrderCheck(BaseNode* node, uint64_t min, uint64_t max, std::vector<uint64_t>& keys, bool stop);
+    bool SimulateSplitCrash(FPtree& tree);
+    bool SimulateDeleteRangeCrash(FPtree& tree, uint64_t& lo, uint64_t& hi);
+    uint64_t CountLeaves(FPtree& tree, LeafNode** full);
+    bool FindGap(FPtree& tree, uint64_t& key, LeafNode** gap_leaf = nullptr);
 
 	uint64_t kv_missing_count_;
 	uint64_t kv_duplicate_count_;
+	uint64_t leaf_order_violation_count_;
 	uint64_t inner_order_violation_count_;
 	uint64_t inner_boundary_violation_count_;
 	uint64_t inner_duplicate_count_;
@@ -124,7 +164,7 @@ bool Inspector::SanityCheck(FPtree& tree, std::vector<uint64_t>& keys, std::vect
 		printf("Skip innernode check.\n");
 	#endif
 
-	return !(kv_missing_count_ || kv_duplicate_count_ || inner_order_violation_count_ || 
+	return !(kv_missing_count_ || kv_duplicate_count_ || leaf_order_violation_count_ || inner_order_violation_count_ || 
 	inner_boundary_violation_count_ || inner_duplicate_count_ || inner_invalid_count_);
 }
 
@@ -151,6 +191,13 @@ void Inspector::KVPresenceCheck(FPtree& tree, std::vector<uint64_t>& keys, std::
 		for (i = 0; i < MAX_LEAF_SIZE; i++)
 			if (cur->bitmap.test(i))
 				vec.push_back(cur->kv_pairs[i].key);
+		for (i = 0; i < cur->bitmap.count(); i++)	// sorted slots must list valid kvs in key order
+			if (!cur->bitmap.test(cur->sortedSlots()[i]) || 
+				(i && cur->kv_pairs[cur->sortedSlots()[i-1]].key >= cur->kv_pairs[cur->sortedSlots()[i]].key))
+			{
+				std::cout << "Leaf sorted slot violation at position: " << i << std::endl;
+				leaf_order_violation_count_ ++;
+			}
 		#ifdef PMEM
 			cur = (struct LeafNode *) pmemobj_direct((cur->p_next).oid);
 		#else
@@ -258,10 +305,113 @@ void Inspector::SubtreeOrderCheck(BaseNode* node, uint64_t min, uint64_t max, st
 	}
 }
 
+/*
+	Leave the pool as a crash inside a three way split by mergeSorted would: the new leaves are linked
+	and logged, but the bitmap of the split leaf still holds a key of each of them. recoverSplit must
+	drop both, not only the keys of the leaf in the log. Return false if no leaf has room for them.
+*/
+bool Inspector::SimulateSplitCrash(FPtree& tree)
+{
+	LeafNode* leaf = tree.minLeaf(tree.root), *first, *second;
+	while (true)
+	{
+		first = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid);
+		if (first == nullptr)
+			return false;
+		second = (struct LeafNode *) pmemobj_direct((first->p_next).oid);
+		if (second == nullptr)
+			return false;
+		if (leaf->bitmap.count() + 2 <= MAX_LEAF_SIZE && first->bitmap.count() && second->bitmap.count())
+			break;
+		leaf = first;
+	}
+	for (LeafNode* moved : {first, second})
+	{
+		uint64_t idx = leaf->bitmap.first_zero();
+		leaf->kv_pairs[idx] = moved->kv_pairs[moved->sortedSlots()[0]];
+		leaf->bitmap.set(idx);
+	}
+	List* list = D_RW(POBJ_ROOT(pop, struct List));
+	list->logs[0].split.PCurrentLeaf = pmemobj_oid(leaf);
+	list->logs[0].split.PLeaf = leaf->p_next;
+	return true;
+}
+
+/*
+	Leave the pool as a crash inside a deleteRange from the max key of a leaf to the min key of the third
+	leaf after it would: the log is written and the first leaf is trimmed, the last leaf is not and the
+	two leaves in between are still linked. Recovery must finish all of it. Set lo and hi to the range
+	deleted, return false if no leaves are large enough for it.
+*/
+bool Inspector::SimulateDeleteRangeCrash(FPtree& tree, uint64_t& lo, uint64_t& hi)
+{
+	LeafNode* leaves[4] = {tree.minLeaf(tree.root)};
+	while (true)
+	{
+		uint64_t i;
+		for (i = 1; i < 4 && leaves[i - 1] != nullptr; i++)
+			leaves[i] = (struct LeafNode *) pmemobj_direct((leaves[i - 1]->p_next).oid);
+		if (i < 4 || leaves[3] == nullptr)
+			return false;
+		if (leaves[0]->bitmap.count() > 1 && leaves[1]->bitmap.count() && leaves[2]->bitmap.count() && 
+			leaves[3]->bitmap.count() > 1)
+			break;
+		leaves[0] = leaves[1];
+	}
+	uint64_t first = leaves[0]->sortedSlots()[leaves[0]->bitmap.count() - 1], last = leaves[3]->sortedSlots()[0];
+	lo = leaves[0]->kv_pairs[first].key;
+	hi = leaves[3]->kv_pairs[last].key;
+
+	RangeLog& log = D_RW(POBJ_ROOT(pop, struct List))->logs[0].range;
+	log.PLeaf = pmemobj_oid(leaves[0]);
+	log.PFirst = leaves[0]->p_next;
+	log.PAfter = leaves[2]->p_next;
+	log.PTrimmed[0] = pmemobj_oid(leaves[0]);
+	log.PTrimmed[1] = leaves[2]->p_next;
+	log.bitmaps[0] = leaves[0]->bitmap.bits & ~((uint64_t)1 << first);
+	log.bitmaps[1] = leaves[3]->bitmap.bits & ~((uint64_t)1 << last);
+	log.valid = 1;
+	leaves[0]->bitmap.reset(first);
+	return true;
+}
+
+// return number of leaves in the leaf list, set full to the first full leaf if it is nullptr
+uint64_t Inspector::CountLeaves(FPtree& tree, LeafNode** full)
+{
+	uint64_t count = 0;
+	for (LeafNode* leaf = tree.minLeaf(tree.root); leaf != nullptr; 
+		 leaf = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid), count++)
+		if (*full == nullptr && leaf->isFull())
+			*full = leaf;
+	return count;
+}
+
+// set key to a missing key between the two smallest keys of a leaf with room for it, return false if
+// there is no such leaf. Inserting and then deleting key neither splits nor removes a leaf
+bool Inspector::FindGap(FPtree& tree, uint64_t& key, LeafNode** gap_leaf)
+{
+	for (LeafNode* leaf = tree.minLeaf(tree.root); leaf != nullptr; 
+		 leaf = (struct LeafNode *) pmemobj_direct((leaf->p_next).oid))
+	{
+		uint64_t count = leaf->bitmap.count();
+		if (count < 2 || count >= MAX_LEAF_SIZE)
+			continue;
+		key = leaf->kv_pairs[leaf->sortedSlots()[0]].key + 1;
+		if (key < leaf->kv_pairs[leaf->sortedSlots()[1]].key)
+		{
+			if (gap_leaf != nullptr)
+				*gap_leaf = leaf;
+			return true;
+		}
+	}
+	return false;
+}
+
 void Inspector::ClearStats()
 {
 	kv_missing_count_ = 0;
 	kv_duplicate_count_ = 0;
+	leaf_order_violation_count_ = 0;
 	inner_order_violation_count_ = 0;
 	inner_boundary_violation_count_ = 0;
 	inner_duplicate_count_ = 0;
@@ -305,6 +455,28 @@ void thread_delete(FPtree & tree, std::vector<uint64_t> & keys, uint64_t id) {
 			printf("Delete failed! Key: %llu \n", keys[i]);
 }
 
+// keys and values as records sorted by key
+std::vector<KV> sortedRecords(std::vector<uint64_t>& keys, std::vector<uint64_t>& values) {
+	std::vector<KV> records(keys.size());
+	for (uint64_t i = 0; i < keys.size(); i++)
+		records[i] = KV(keys[i], values[i]);
+	std::sort(records.begin(), records.end(), [] (const KV& kv1, const KV& kv2) { return kv1.key < kv2.key; });
+	return records;
+}
+
+// close tree and open the pool at path again: cleanly, so the inner nodes are mapped back from the snapshot,
+// or as after a crash, so the logs are replayed and the inner nodes rebuilt (in the background with lazy)
+void reopen(FPtree & tree, const char* path, bool crash, bool lazy = false) {
+	PMEMobjpool* pool = pop;
+	if (crash)
+		pop = NULL;		// the destructor saves no snapshot
+	tree.~FPtree();
+	if (crash)
+		pmemobj_close(pool);
+	new (&tree) FPtree();
+	tree.pmemInit(path, PMEMOBJ_POOL_SIZE, lazy);
+}
+
 int main()
 {
 	printf("Number of Records: %llu\n", NUM_RECORDS);
@@ -321,6 +493,7 @@ int main()
     std::cout << "Key generation complete, start loading...\n";
 
 	const char* path = "./test_pool";
+	remove(path);	// a pool left by an earlier run would be reopened instead
     FPtree fptree;
 	fptree.pmemInit(path, PMEMOBJ_POOL_SIZE);
 
@@ -381,6 +554,658 @@ int main()
 		#endif
 	#endif
 
+	#if CHECK_BATCH == 1
+		printf("Inserting %d keys with insertBatch.\n", NUM_BATCH_RECORDS);
+		{
+			std::vector<KV> batch(NUM_BATCH_RECORDS);
+			for (KV& kv : batch)
+				kv = KV(rbe(), rbe());
+			uint64_t applied = fptree.insertBatch(batch.data(), batch.size());
+			if (applied != batch.size())
+			{
+				printf("insertBatch applied %llu of %llu records!\n", applied, batch.size());
+				return -1;
+			}
+			for (KV& kv : batch)
+			{
+				keys.push_back(kv.key);
+				values.push_back(kv.value);
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for insertBatch passed!\n";
+			else
+				return -1;
+
+			printf("Deleting half of them with deleteBatch.\n");
+			uint64_t half = batch.size() / 2;
+			std::vector<uint64_t> del(keys.end() - half, keys.end());
+			applied = fptree.deleteBatch(del.data(), del.size());
+			if (applied != half)
+			{
+				printf("deleteBatch applied %llu of %llu keys!\n", applied, half);
+				return -1;
+			}
+			keys.erase(keys.end() - half, keys.end());
+			values.erase(values.end() - half, values.end());
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for deleteBatch passed!\n";
+			else
+				return -1;
+		}
+	#else
+		printf("Skip batch check.\n");
+	#endif
+
+	#if CHECK_FIND_BATCH == 1
+		printf("Looking up present and absent keys with findBatch and findInterleaved.\n");
+		{
+			std::vector<uint64_t> lookup(keys), batch_out(keys.size() * 2), interleaved_out(keys.size() * 2);
+			for (uint64_t i = 0; i < keys.size(); i++)
+				lookup.push_back(rbe());	// absent but for a negligible chance
+			std::shuffle(lookup.begin(), lookup.end(), std::default_random_engine(0));
+			fptree.findBatch(lookup.data(), lookup.size(), batch_out.data());
+			fptree.findInterleaved(lookup.data(), lookup.size(), interleaved_out.data());
+			uint64_t mismatches = 0;
+			for (uint64_t i = 0; i < lookup.size(); i++)
+			{
+				uint64_t value = fptree.find(lookup[i]);
+				if (batch_out[i] != value || interleaved_out[i] != value)
+				{
+					if (mismatches++ < 10)
+						printf("Key %llu: find %llu, findBatch %llu, findInterleaved %llu\n", lookup[i], value, 
+							   batch_out[i], interleaved_out[i]);
+				}
+			}
+			if (mismatches)
+			{
+				printf("%llu lookups disagree with find!\n", mismatches);
+				return -1;
+			}
+			std::cout << "Batched lookup check passed!\n";
+		}
+	#else
+		printf("Skip batched lookup check.\n");
+	#endif
+
+	#if CHECK_SCAN == 1
+		printf("Scanning the middle quarter of keys with key and value filters.\n");
+		{
+			std::vector<KV> records = sortedRecords(keys, values);
+			uint64_t lo = records[records.size() / 4].key, hi = records[records.size() / 2].key;
+			ScanOptions options;
+			options.output = ScanColumns;
+			options.key_filter = [] (uint64_t key) { return key % 3 == 0; };
+			options.value_filter = [] (uint64_t value) { return (value & 1) == 1; };
+			std::vector<uint64_t> expected, scanned;
+			for (KV& kv : records)
+				if (kv.key >= lo && kv.key <= hi && kv.key % 3 == 0 && (kv.value & 1) == 1)
+				{
+					expected.push_back(kv.key);
+					expected.push_back(kv.value);
+				}
+			auto visitor = [&scanned] (const ScanChunk& chunk) {
+				for (uint64_t i = 0; i < chunk.count; i++)
+				{
+					scanned.push_back(chunk.keys[i]);
+					scanned.push_back(chunk.values[i]);
+				}
+				return true;
+			};
+			uint64_t emitted = fptree.scanRange(lo, hi, std::numeric_limits<uint64_t>::max(), visitor, options);
+			if (emitted != expected.size() / 2 || scanned != expected)
+			{
+				printf("scanRange emitted %llu records, %llu expected!\n", emitted, expected.size() / 2);
+				return -1;
+			}
+			// a limit cuts the scan short inside a leaf
+			uint64_t limit = expected.size() / 4 + 1;
+			scanned.clear();
+			emitted = fptree.scanRange(lo, hi, limit, visitor, options);
+			if (emitted != limit || scanned.size() != 2 * limit || !std::equal(scanned.begin(), scanned.end(), expected.begin()))
+			{
+				printf("scanRange with limit %llu emitted %llu records!\n", limit, emitted);
+				return -1;
+			}
+			std::cout << "Scan check passed!\n";
+		}
+	#else
+		printf("Skip scan check.\n");
+	#endif
+
+	#if CHECK_CURSOR == 1
+		printf("Iterating from the middle of the keys with a cursor.\n");
+		{
+			std::vector<KV> records = sortedRecords(keys, values);
+			uint64_t start_pos = records.size() / 2, batch_size = 3 * MAX_LEAF_SIZE + 1, i, copied;
+			std::vector<KV> out(batch_size);
+			KV kv;
+			// seek between two keys lands on the larger one, next and nextBatch then take turns to the end
+			FPtree::Cursor cursor(fptree);
+			cursor.seek(records[start_pos - 1].key + 1);
+			bool ok = true;
+			for (i = start_pos; ok && i < records.size(); )
+			{
+				ok = cursor.next(kv) && kv.key == records[i].key && kv.value == records[i].value;
+				i++;
+				copied = cursor.nextBatch(out.data(), batch_size);
+				ok = ok && copied == std::min<uint64_t>(batch_size, records.size() - i);
+				for (uint64_t j = 0; ok && j < copied; j++)
+					ok = out[j].key == records[i + j].key && out[j].value == records[i + j].value;
+				i += copied;
+			}
+			ok = ok && !cursor.next(kv) && cursor.nextBatch(out.data(), batch_size) == 0;
+			// seek back to the first key, and past the last one
+			cursor.seek(0);
+			ok = ok && cursor.next(kv) && kv.key == records.front().key;
+			cursor.seek(records.back().key + 1);
+			ok = ok && (records.back().key == std::numeric_limits<uint64_t>::max() || !cursor.next(kv));
+			if (!ok)
+			{
+				printf("Cursor diverged from the records at position %llu!\n", i);
+				return -1;
+			}
+			std::cout << "Cursor check passed!\n";
+		}
+	#else
+		printf("Skip cursor check.\n");
+	#endif
+
+	#if CHECK_AGGREGATE == 1
+		printf("Aggregating the values of the middle quarter of keys.\n");
+		{
+			std::vector<KV> records = sortedRecords(keys, values);
+			uint64_t lo = records[records.size() / 4].key, hi = records[records.size() / 2].key;
+			uint64_t count = 0, sum = 0, min_value = std::numeric_limits<uint64_t>::max(), max_value = 0, got_min, got_max;
+			for (KV& kv : records)
+				if (kv.key >= lo && kv.key <= hi)
+				{
+					count++;
+					sum += kv.value;
+					min_value = std::min(min_value, kv.value);
+					max_value = std::max(max_value, kv.value);
+				}
+			if (fptree.countRange(lo, hi) != count || fptree.sumRange(lo, hi) != sum || 
+				!fptree.minMaxRange(lo, hi, got_min, got_max) || got_min != min_value || got_max != max_value)
+			{
+				printf("Aggregates over [%llu, %llu] differ from the records!\n", lo, hi);
+				return -1;
+			}
+			// a range between two adjacent keys holds no record
+			lo = records[records.size() / 3].key + 1;
+			hi = records[records.size() / 3 + 1].key - 1;
+			if (lo <= hi && (fptree.countRange(lo, hi) != 0 || fptree.sumRange(lo, hi) != 0 || 
+							 fptree.minMaxRange(lo, hi, got_min, got_max)))
+			{
+				printf("Aggregates over the empty range [%llu, %llu] found records!\n", lo, hi);
+				return -1;
+			}
+			std::cout << "Aggregate check passed!\n";
+		}
+	#else
+		printf("Skip aggregate check.\n");
+	#endif
+
+	#if CHECK_UPDATE_IN_PLACE == 1 && !defined(OUT_OF_PLACE_UPDATE)
+		printf("Updating every key of a full leaf in place.\n");
+		{
+			LeafNode* full = nullptr;
+			uint64_t leaves = ins.CountLeaves(fptree, &full);
+			if (full == nullptr)
+			{
+				// fill the gap of a leaf with room, none of these inserts splits it
+				uint64_t key;
+				if (!ins.FindGap(fptree, key, &full))
+				{
+					printf("No leaf to fill for the update!\n");
+					return -1;
+				}
+				uint64_t upper = full->kv_pairs[full->sortedSlots()[1]].key;
+				for (; !full->isFull() && key < upper; key++)
+				{
+					uint64_t value = rbe();
+					if (!fptree.insert(KV(key, value)))
+					{
+						printf("Insert of key %llu failed!\n", key);
+						return -1;
+					}
+					keys.push_back(key);
+					values.push_back(value);
+				}
+				if (!full->isFull())
+				{
+					printf("No full leaf to update!\n");
+					return -1;
+				}
+			}
+			std::unordered_map<uint64_t, uint64_t> updated;
+			for (uint64_t i = 0; i < MAX_LEAF_SIZE; i++)
+				updated[full->kv_pairs[i].key] = rbe();
+			for (auto& kv : updated)
+				if (!fptree.update(KV(kv.first, kv.second)))
+				{
+					printf("Update of key %llu failed!\n", kv.first);
+					return -1;
+				}
+			for (uint64_t i = 0; i < keys.size(); i++)
+				if (updated.count(keys[i]))
+					values[i] = updated[keys[i]];
+			LeafNode* ignored = nullptr;
+			if (ins.CountLeaves(fptree, &ignored) != leaves)
+			{
+				printf("Updates in a full leaf changed the number of leaves!\n");
+				return -1;
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for in-place update passed!\n";
+			else
+				return -1;
+		}
+	#else
+		printf("Skip in-place update check.\n");
+	#endif
+
+	#if CHECK_PERSIST_STATS == 1
+		printf("Counting flushes and fences of single operations.\n");
+		{
+			uint64_t key;
+			if (!ins.FindGap(fptree, key))
+			{
+				printf("No leaf with room for a key!\n");
+				return -1;
+			}
+			bool ok = true;
+			auto expect = [&ok] (const char* op, uint64_t min_flushes, uint64_t max_flushes, uint64_t fences) {
+				PersistStats stats = FPtree::persistStats();
+				printf("%s: %llu flushes, %llu fences\n", op, stats.flushes, stats.fences);
+				ok = ok && stats.flushes >= min_flushes && stats.flushes <= max_flushes && stats.fences == fences;
+				FPtree::resetPersistStats();
+			};
+			FPtree::resetPersistStats();
+			fptree.find(keys[0]);
+			expect("find", 0, 0, 0);
+			fptree.insert(KV(key, 1));
+			// the kv line, then fingerprint and bitmap, which share a line only with LEAF_HEADER_LINE
+			#ifdef LEAF_HEADER_LINE
+				expect("insert", 2, 2, 2);
+			#else
+				expect("insert", 2, 3, 2);
+			#endif
+			#ifndef OUT_OF_PLACE_UPDATE
+				fptree.update(KV(key, 2));
+				expect("update", 1, 1, 1);
+			#endif
+			fptree.deleteKey(key);
+			expect("delete", 1, 1, 1);
+			if (!ok)
+			{
+				printf("Persist counts differ from the cost of the operations!\n");
+				return -1;
+			}
+			std::cout << "Persist stats check passed!\n";
+		}
+	#else
+		printf("Skip persist stats check.\n");
+	#endif
+
+	#if CHECK_RMW == 1
+		printf("Running upsert, fetchAdd and compareAndSwap on existing and missing keys.\n");
+		{
+			std::vector<KV> records = sortedRecords(keys, values);
+			auto missingKey = [&] () {
+				uint64_t key;
+				do
+					key = rbe();
+				while (std::binary_search(records.begin(), records.end(), KV(key, 0), 
+										  [] (const KV& kv1, const KV& kv2) { return kv1.key < kv2.key; }));
+				return key;
+			};
+			uint64_t n = std::min<uint64_t>(keys.size() / 3, 1000), key, value, old_value;
+			bool found;
+			for (uint64_t i = 0; i < n; i++)
+			{
+				// upsert overwrites keys[i] and inserts a missing key
+				value = rbe();
+				if (fptree.upsert(KV(keys[i], value)))
+				{
+					printf("upsert inserted existing key %llu!\n", keys[i]);
+					return -1;
+				}
+				values[i] = value;
+				key = missingKey();
+				value = rbe();
+				if (!fptree.upsert(KV(key, value)))
+				{
+					printf("upsert did not insert missing key %llu!\n", key);
+					return -1;
+				}
+				keys.push_back(key);
+				values.push_back(value);
+
+				// fetchAdd returns the old value of keys[n + i], and inserts the delta for a missing key
+				if (!fptree.fetchAdd(keys[n + i], i, old_value, &found) || !found || old_value != values[n + i])
+				{
+					printf("fetchAdd on existing key %llu returned %llu!\n", keys[n + i], old_value);
+					return -1;
+				}
+				values[n + i] += i;
+				key = missingKey();
+				value = rbe() | 1;
+				if (!fptree.fetchAdd(key, value, old_value, &found) || found || old_value != 0)
+				{
+					printf("fetchAdd did not insert missing key %llu!\n", key);
+					return -1;
+				}
+				keys.push_back(key);
+				values.push_back(value);
+
+				// compareAndSwap on keys[2n + i] fails on a wrong expected value, then succeeds
+				value = rbe();
+				if (fptree.compareAndSwap(keys[2 * n + i], values[2 * n + i] + 1, value) || 
+					!fptree.compareAndSwap(keys[2 * n + i], values[2 * n + i], value))
+				{
+					printf("compareAndSwap on key %llu did not swap exactly once!\n", keys[2 * n + i]);
+					return -1;
+				}
+				values[2 * n + i] = value;
+				key = missingKey();
+				if (fptree.compareAndSwap(key, 0, value) || fptree.find(key) != 0)
+				{
+					printf("compareAndSwap on missing key %llu swapped!\n", key);
+					return -1;
+				}
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for read-modify-write passed!\n";
+			else
+				return -1;
+
+			// the same through the PiBench wrapper, on a pool of its own
+			fptree.~FPtree();
+			{
+				const char* wrapper_path = "./wrapper_pool";
+				remove(wrapper_path);
+				fptree_wrapper wrapper(wrapper_path, SMALL_POOL_SIZE);
+				uint64_t k = 1, k_missing = 2, v = 10, expected, desired, out = 0;
+				const char* kp = reinterpret_cast<const char*> (&k);
+				const char* vp = reinterpret_cast<const char*> (&v);
+				char* op = reinterpret_cast<char*> (&out);
+				bool ok = wrapper.upsert(kp, 8, vp, 8);				// inserted, k = 10
+				v = 20;
+				ok = ok && !wrapper.upsert(kp, 8, vp, 8);			// overwritten, k = 20
+				ok = ok && wrapper.fetchAdd(kp, 8, 5, op) && out == 20;	// k = 25
+				ok = ok && wrapper.fetchAdd(reinterpret_cast<const char*> (&k_missing), 8, 3, op) && out == 0;	// inserted
+				expected = 24;
+				desired = 30;
+				ok = ok && !wrapper.compareAndSwap(kp, 8, reinterpret_cast<const char*> (&expected), 
+												   reinterpret_cast<const char*> (&desired), 8);
+				expected = 25;
+				ok = ok && wrapper.compareAndSwap(kp, 8, reinterpret_cast<const char*> (&expected), 
+												  reinterpret_cast<const char*> (&desired), 8);
+				ok = ok && wrapper.find(kp, 8, op) && out == 30;
+				ok = ok && wrapper.find(reinterpret_cast<const char*> (&k_missing), 8, op) && out == 3;
+				if (!ok)
+				{
+					printf("Read-modify-write through fptree_wrapper failed!\n");
+					return -1;
+				}
+				std::cout << "Read-modify-write through fptree_wrapper passed!\n";
+			}
+			new (&fptree) FPtree();
+			fptree.pmemInit(path, PMEMOBJ_POOL_SIZE);
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for read-modify-write after reopen passed!\n";
+			else
+				return -1;
+		}
+	#else
+		printf("Skip read-modify-write check.\n");
+	#endif
+
+	#if CHECK_DELETE_RANGE == 1
+		printf("Deleting a range of keys spanning many leaves and one inside a leaf.\n");
+		{
+			std::vector<KV> records = sortedRecords(keys, values);
+			std::pair<uint64_t, uint64_t> ranges[] = {
+				{records[records.size() / 3].key, records[records.size() / 3 + records.size() / 10].key},
+				{records[records.size() / 5].key + 1, records[records.size() / 5 + 2].key}
+			};
+			for (auto& range : ranges)
+			{
+				uint64_t expected = 0, j = 0;
+				for (uint64_t i = 0; i < keys.size(); i++)
+				{
+					if (keys[i] >= range.first && keys[i] <= range.second)
+					{
+						expected++;
+						continue;
+					}
+					keys[j] = keys[i];
+					values[j++] = values[i];
+				}
+				keys.resize(j);
+				values.resize(j);
+				uint64_t deleted = fptree.deleteRange(range.first, range.second);
+				if (deleted != expected)
+				{
+					printf("deleteRange deleted %llu keys, %llu expected!\n", deleted, expected);
+					return -1;
+				}
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for deleteRange passed!\n";
+			else
+				return -1;
+		}
+
+		printf("Recovering from a crash inside a deleteRange over four leaves.\n");
+		{
+			uint64_t lo, hi, j = 0;
+			if (!ins.SimulateDeleteRangeCrash(fptree, lo, hi))
+			{
+				printf("No leaves to delete!\n");
+				return -1;
+			}
+			for (uint64_t i = 0; i < keys.size(); i++)
+			{
+				if (keys[i] >= lo && keys[i] <= hi)
+					continue;
+				keys[j] = keys[i];
+				values[j++] = values[i];
+			}
+			keys.resize(j);
+			values.resize(j);
+			reopen(fptree, path, true);
+			if (fptree.countRange(lo, hi) != 0)
+			{
+				printf("Keys left in the range after recovery!\n");
+				return -1;
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for deleteRange recovery passed!\n";
+			else
+				return -1;
+		}
+	#else
+		printf("Skip deleteRange check.\n");
+	#endif
+
+	#if CHECK_MERGE == 1
+		printf("Merging sorted runs of %d keys after every %d-th key.\n", MERGE_RUN_SIZE, MERGE_STRIDE);
+		{
+			std::vector<KV> records = sortedRecords(keys, values), run;
+			uint64_t expected = 0, gap;
+			for (uint64_t i = 0; i + 1 < records.size(); i += MERGE_STRIDE)
+			{
+				run.push_back(KV(records[i].key, rbe()));	// exists, must be skipped and keep its value
+				gap = (records[i + 1].key - records[i].key) / (MERGE_RUN_SIZE + 1);
+				for (uint64_t j = 1; gap && j <= MERGE_RUN_SIZE; j++)
+				{
+					run.push_back(KV(records[i].key + j * gap, rbe()));
+					keys.push_back(run.back().key);
+					values.push_back(run.back().value);
+					expected++;
+				}
+			}
+			uint64_t inserted = fptree.mergeSorted(run.data(), run.size());
+			if (inserted != expected)
+			{
+				printf("mergeSorted inserted %llu keys, %llu expected!\n", inserted, expected);
+				return -1;
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for mergeSorted passed!\n";
+			else
+				return -1;
+		}
+
+		printf("Recovering from a crash inside a three way split.\n");
+		if (!ins.SimulateSplitCrash(fptree))
+		{
+			printf("No leaf to split!\n");
+			return -1;
+		}
+		reopen(fptree, path, true);
+		if (ins.SanityCheck(fptree, keys, values))
+			std::cout << "Sanity check for split recovery passed!\n";
+		else
+			return -1;
+	#else
+		printf("Skip merge check.\n");
+	#endif
+
+	#if CHECK_REOPEN == 1
+		printf("Reopening the tree from its snapshot.\n");
+		reopen(fptree, path, false);
+		if (ins.SanityCheck(fptree, keys, values))
+			std::cout << "Sanity check for snapshot reopen passed!\n";
+		else
+			return -1;
+	#else
+		printf("Skip reopen check.\n");
+	#endif
+
+	#if CHECK_LAZY_REOPEN == 1
+		printf("Reopening the tree after a crash with lazy rebuild.\n");
+		{
+			reopen(fptree, path, true, true);
+			// insert and delete while the inner nodes are being rebuilt
+			std::vector<KV> batch(NUM_BATCH_RECORDS / 10);
+			for (KV& kv : batch)
+				kv = KV(rbe(), rbe());
+			if (fptree.insertBatch(batch.data(), batch.size()) != batch.size())
+			{
+				printf("insertBatch failed during lazy rebuild!\n");
+				return -1;
+			}
+			uint64_t half = keys.size() / 2;
+			std::vector<uint64_t> del(keys.begin() + half, keys.begin() + half + batch.size());
+			if (fptree.deleteBatch(del.data(), del.size()) != del.size())
+			{
+				printf("deleteBatch failed during lazy rebuild!\n");
+				return -1;
+			}
+			keys.erase(keys.begin() + half, keys.begin() + half + batch.size());
+			values.erase(values.begin() + half, values.begin() + half + batch.size());
+			for (KV& kv : batch)
+			{
+				keys.push_back(kv.key);
+				values.push_back(kv.value);
+			}
+			fptree.awaitIndex();
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for lazy reopen passed!\n";
+			else
+				return -1;
+		}
+	#else
+		printf("Skip lazy reopen check.\n");
+	#endif
+
+	#if CHECK_BULK_BUILD == 1
+		{
+			std::vector<KV> records = sortedRecords(keys, values);
+			for (float load_factor : {1.0f, 0.7f, 0.5f})
+			{
+				printf("Bulk building the tree at load factor %.1f.\n", load_factor);
+				if (fptree.deleteRange(0, std::numeric_limits<uint64_t>::max()) != records.size())
+				{
+					printf("Failed to empty the tree!\n");
+					return -1;
+				}
+				uint64_t loaded = fptree.bulkBuild(records.data(), records.size(), load_factor);
+				if (loaded != records.size())
+				{
+					printf("bulkBuild loaded %llu of %llu records!\n", loaded, records.size());
+					return -1;
+				}
+				if (ins.SanityCheck(fptree, keys, values))
+					std::cout << "Sanity check for bulkBuild passed!\n";
+				else
+					return -1;
+			}
+		}
+	#else
+		printf("Skip bulkBuild check.\n");
+	#endif
+
+	#if CHECK_POOL_FULL == 1
+		printf("Bulk building a tree in a small pool until it runs out of leaves.\n");
+		{
+			const char* small_path = "./small_pool";
+			remove(small_path);
+			fptree.~FPtree();
+			new (&fptree) FPtree();
+			fptree.pmemInit(small_path, SMALL_POOL_SIZE);
+			std::vector<KV> records(SMALL_POOL_SIZE / sizeof(KV));
+			for (uint64_t i = 0; i < records.size(); i++)
+				records[i] = KV(i + 1, rbe());
+			uint64_t loaded = fptree.bulkBuild(records.data(), records.size());
+			if (loaded != 0 || fptree.getRoot() != nullptr)
+			{
+				printf("bulkBuild loaded %llu records into a full pool!\n", loaded);
+				return -1;
+			}
+			// the leaves of the failed build must be free again
+			records.resize(records.size() / 4);
+			keys.clear();
+			values.clear();
+			for (KV& kv : records)
+			{
+				keys.push_back(kv.key);
+				values.push_back(kv.value);
+			}
+			loaded = fptree.bulkBuild(records.data(), records.size());
+			if (loaded != records.size())
+			{
+				printf("bulkBuild loaded %llu of %llu records after a failed build!\n", loaded, records.size());
+				return -1;
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for bulkBuild in a full pool passed!\n";
+			else
+				return -1;
+			// fetchAdd on missing keys must report the insert that fails once the pool is out of leaves
+			uint64_t key = records.back().key, old_value;
+			bool found;
+			while (fptree.fetchAdd(++key, 1, old_value, &found))
+			{
+				keys.push_back(key);
+				values.push_back(1);
+			}
+			if (found || fptree.find(key) != 0)
+			{
+				printf("fetchAdd on missing key %llu failed but the key is stored!\n", key);
+				return -1;
+			}
+			if (ins.SanityCheck(fptree, keys, values))
+				std::cout << "Sanity check for fetchAdd in a full pool passed!\n";
+			else
+				return -1;
+		}
+	#else
+		printf("Skip full pool check.\n");
+	#endif
+
 	#if BULK_LOAD
 		printf("Bulk load current index!\n");
 		FPtree bulk_load_tree;